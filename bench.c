@@ -0,0 +1,481 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+/*Benchmark driver: runs workloads on a scratch disk image and prints one JSON object per line
+on the standard output for each measurement. Everything else the file system prints goes to the
+standard error, so the output can be fed to other tools as is.*/
+
+static FILE *out;	// the JSON lines
+static const char *image = "bench.img";
+static int nblocks = 65536;	// size of the disk, except for the mount workload
+static int file_blocks = 8192;	// size of the file the read/write workloads use
+static int nops = 4096;	// operations of the random, churn and durable workloads
+static int nthreads = 8;	// threads of the durable workload
+static int layout = FS_LAYOUT_BLOCKS;
+static struct disk_config config;
+
+static char *buffer;	// data of the transfers
+static double *latencies;	// of the operations being measured, in seconds
+static int nlatencies;
+static int max_latencies;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*xorshift64, so that every run issues the same operations.*/
+static unsigned long random_state = 88172645463325252UL;
+
+static unsigned long next_random()
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+static void record( double latency )
+{
+	if (nlatencies == max_latencies) {
+		max_latencies = max_latencies == 0 ? 4096 : 2 * max_latencies;
+		latencies = realloc(latencies, max_latencies * sizeof(double));
+	}
+	latencies[nlatencies++] = latency;
+}
+
+static int compare_latencies( const void *a, const void *b )
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*Returns the latency below which a fraction p of the recorded ones are, in microseconds.*/
+static double percentile( double p )
+{
+	if (nlatencies == 0) {
+		return 0;
+	}
+	return latencies[(int)(p * (nlatencies - 1))] * 1e6;
+}
+
+/*Prints the measurement of a workload: ops operations moving bytes bytes in seconds,
+the recorded latencies and the disk activity between before and after. extra holds more JSON members, or is empty.*/
+static void report( const char *workload, int io_size, int ops, long bytes, double seconds,
+	const struct disk_stats *before, const struct disk_stats *after, const char *extra )
+{
+	long hits = after->hits - before->hits;
+	long misses = after->misses - before->misses;
+
+	qsort(latencies, nlatencies, sizeof(double), compare_latencies);
+	fprintf(out, "{\"workload\":\"%s\",\"layout\":\"%s\",\"io_size\":%d,\"ops\":%d,\"bytes\":%ld,\"seconds\":%.6f,"
+		"\"mb_per_s\":%.2f,\"ops_per_s\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+		"\"reads\":%ld,\"writes\":%ld,\"read_ops\":%ld,\"write_ops\":%ld,\"hits\":%ld,\"misses\":%ld,\"hit_ratio\":%.4f%s}\n",
+		workload, layout == FS_LAYOUT_EXTENTS ? "extents" : "blocks", io_size, ops, bytes, seconds,
+		seconds > 0 ? bytes / seconds / (1024 * 1024) : 0, seconds > 0 ? ops / seconds : 0,
+		percentile(0.5), percentile(0.99),
+		after->reads - before->reads, after->writes - before->writes,
+		after->read_ops - before->read_ops, after->write_ops - before->write_ops,
+		hits, misses, hits + misses > 0 ? (double)hits / (hits + misses) : 0, extra);
+	fflush(out);
+	nlatencies = 0;
+}
+
+/*Opens the image with size blocks and a cache of cache_blocks blocks (see struct disk_config).*/
+static void open_disk( int size, int cache_blocks )
+{
+	struct disk_config options = config;
+	options.cache_blocks = cache_blocks;
+	if (!disk_init_config(image, size, &options)) {
+		perror(image);
+		exit(1);
+	}
+}
+
+/*Opens the image and creates a mounted file system in it, with a file of file_blocks blocks if fill is set.
+Returns the i-node of that file.*/
+static int new_fs( int size, int fill )
+{
+	open_disk(size, config.cache_blocks);
+	if (fs_format_layout(layout) != 0 || fs_mount() != 0) {
+		fprintf(stderr, "cannot create the file system\n");
+		exit(1);
+	}
+	int inumber = fs_create();
+	for (int block = 0; fill && block < file_blocks; block += 256) {
+		int length = (file_blocks - block < 256 ? file_blocks - block : 256) * DISK_BLOCK_SIZE;
+		fs_write(inumber, buffer, length, block * DISK_BLOCK_SIZE);
+	}
+	fs_sync();
+	return inumber;
+}
+
+static void close_fs()
+{
+	fs_unmount();
+	disk_close();
+}
+
+/*Remounts the file system with a cold cache of cache_blocks blocks.*/
+static void remount( int cache_blocks )
+{
+	close_fs();
+	open_disk(nblocks, cache_blocks);
+	if (fs_mount() != 0) {
+		exit(1);
+	}
+}
+
+/*Sequential write of a file, then sequential read of it with a cold cache, at several I/O sizes.
+The write includes the fs_sync that makes it durable.*/
+static void bench_sequential()
+{
+	int sizes[] = { 4096, 65536, 1048576 };
+	long file_bytes = (long)file_blocks * DISK_BLOCK_SIZE;
+	struct disk_stats before, after;
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int size = sizes[s];
+		int ops = file_bytes / size;
+		int inumber = new_fs(nblocks, 0);
+
+		disk_stats(&before);
+		double start = now();
+		for (int i = 0; i < ops; i++) {
+			double t = now();
+			fs_write(inumber, buffer, size, i * size);
+			record(now() - t);
+		}
+		fs_sync();
+		double seconds = now() - start;
+		disk_stats(&after);
+		report("seqwrite", size, ops, (long)ops * size, seconds, &before, &after, "");
+
+		remount(config.cache_blocks);
+		disk_stats(&before);
+		start = now();
+		for (int i = 0; i < ops; i++) {
+			double t = now();
+			fs_read(inumber, buffer, size, i * size);
+			record(now() - t);
+		}
+		seconds = now() - start;
+		disk_stats(&after);
+		report("seqread", size, ops, (long)ops * size, seconds, &before, &after, "");
+		close_fs();
+	}
+}
+
+/*Random writes (made durable at the end), then random reads, at I/O-size-aligned offsets of a file,
+starting with a cold cache.*/
+static void bench_random()
+{
+	int sizes[] = { 4096, 65536 };
+	long file_bytes = (long)file_blocks * DISK_BLOCK_SIZE;
+	struct disk_stats before, after;
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int size = sizes[s];
+		int slots = file_bytes / size;
+		int inumber = new_fs(nblocks, 1);
+		remount(config.cache_blocks);
+
+		disk_stats(&before);
+		double start = now();
+		for (int i = 0; i < nops; i++) {
+			int offset = (int)(next_random() % slots) * size;
+			double t = now();
+			fs_write(inumber, buffer, size, offset);
+			record(now() - t);
+		}
+		fs_sync();
+		double seconds = now() - start;
+		disk_stats(&after);
+		report("randwrite", size, nops, (long)nops * size, seconds, &before, &after, "");
+
+		disk_stats(&before);
+		start = now();
+		for (int i = 0; i < nops; i++) {
+			int offset = (int)(next_random() % slots) * size;
+			double t = now();
+			fs_read(inumber, buffer, size, offset);
+			record(now() - t);
+		}
+		seconds = now() - start;
+		disk_stats(&after);
+		report("randread", size, nops, (long)nops * size, seconds, &before, &after, "");
+		close_fs();
+	}
+}
+
+/*Create, write and delete of short-lived files, with an fs_sync every 64 of them.
+The latency is that of a whole create-write-delete cycle.*/
+static void bench_churn()
+{
+	int size = 16384;
+	struct disk_stats before, after;
+
+	new_fs(nblocks, 0);
+	disk_stats(&before);
+	double start = now();
+	for (int i = 0; i < nops; i++) {
+		double t = now();
+		int inumber = fs_create();
+		fs_write(inumber, buffer, size, 0);
+		fs_delete(inumber);
+		record(now() - t);
+		if (i % 64 == 63) {
+			fs_sync();
+		}
+	}
+	fs_sync();
+	double seconds = now() - start;
+	disk_stats(&after);
+	report("churn", size, nops, (long)nops * size, seconds, &before, &after, "");
+	close_fs();
+}
+
+#define MAX_THREADS 64
+
+/*A thread of the durable workload, with the latency of each of its operations.*/
+struct durable_worker {
+	pthread_t thread;
+	int ops;
+	double *latencies;
+};
+
+static void *run_durable_worker( void *argument )
+{
+	struct durable_worker *worker = argument;
+	int inumber = -1;
+	for (int i = 0; i < worker->ops; i++) {
+		double t = now();
+		switch (i % 3) {
+		case 0: inumber = fs_create(); break;
+		case 1: fs_write(inumber, buffer, DISK_BLOCK_SIZE, 0); break;
+		case 2: fs_delete(inumber); break;
+		}
+		fs_sync();
+		worker->latencies[i] = now() - t;
+	}
+	return NULL;
+}
+
+/*Create, write and delete of 4 KiB files by nthreads threads at once, every operation made durable by an
+fs_sync of its own; the fs_syncs that arrive together share a commit. The latency includes the fs_sync.*/
+static void bench_durable()
+{
+	struct durable_worker workers[MAX_THREADS];
+	struct disk_stats before, after;
+	char extra[64];
+	int ops = nops / nthreads / 3 * 3 > 0 ? nops / nthreads / 3 * 3 : 3;	// whole create-write-delete cycles
+
+	new_fs(nblocks, 0);
+	disk_stats(&before);
+	double start = now();
+	for (int t = 0; t < nthreads; t++) {
+		workers[t].ops = ops;
+		workers[t].latencies = malloc(ops * sizeof(double));
+		pthread_create(&workers[t].thread, NULL, run_durable_worker, &workers[t]);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(workers[t].thread, NULL);
+	}
+	double seconds = now() - start;
+	disk_stats(&after);
+	for (int t = 0; t < nthreads; t++) {
+		for (int i = 0; i < ops; i++) {
+			record(workers[t].latencies[i]);
+		}
+		free(workers[t].latencies);
+	}
+	snprintf(extra, sizeof(extra), ",\"threads\":%d", nthreads);
+	report("durable", DISK_BLOCK_SIZE, ops * nthreads, (long)ops / 3 * nthreads * DISK_BLOCK_SIZE, seconds, &before, &after, extra);
+	close_fs();
+}
+
+/*Fills a new file system of size blocks with 256 files of 64 KiB in a child process,
+which unmounts it if clean is set and otherwise leaves it as after a crash.*/
+static void populate( int size, int clean )
+{
+	fflush(NULL);
+	pid_t child = fork();
+	if (child == 0) {
+		new_fs(size, 0);
+		for (int i = 0; i < 256; i++) {
+			int inumber = fs_create();
+			fs_write(inumber, buffer, 65536, 0);
+		}
+		if (clean) {
+			close_fs();
+		} else {
+			fs_sync();
+		}
+		fflush(NULL);
+		_exit(0);
+	}
+	waitpid(child, NULL, 0);
+}
+
+/*Time of fs_mount against the size of the disk, after a clean unmount and after a crash.*/
+static void bench_mount()
+{
+	int sizes[] = { 16384, 65536, 262144 };
+	struct disk_stats before, after;
+	char extra[64];
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int size = sizes[s];
+		snprintf(extra, sizeof(extra), ",\"nblocks\":%d", size);
+		for (int clean = 1; clean >= 0; clean--) {
+			int reps = clean ? 5 : 3;
+			double seconds = 0;
+			if (clean) {
+				populate(size, 1);
+			}
+			for (int r = 0; r < reps; r++) {
+				if (!clean) {
+					populate(size, 0);
+				}
+				open_disk(size, config.cache_blocks);
+				disk_stats(&before);
+				double t = now();
+				fs_mount();
+				record(now() - t);
+				seconds += now() - t;
+				disk_stats(&after);
+				close_fs();
+			}
+			report(clean ? "mount_clean" : "mount_unclean", 0, reps, 0, seconds, &before, &after, extra);
+		}
+	}
+	unlink(image);
+}
+
+/*Random 4 KiB reads of a file, 80% of them to a fifth of it, with several cache sizes.*/
+static void bench_cachesweep()
+{
+	int caches[] = { 256, 1024, 4096, 16384 };
+	struct disk_stats before, after;
+	char extra[64];
+
+	int inumber = new_fs(nblocks, 1);
+	for (int c = 0; c < sizeof(caches) / sizeof(caches[0]); c++) {
+		remount(caches[c]);
+		snprintf(extra, sizeof(extra), ",\"cache_blocks\":%d", caches[c]);
+		disk_stats(&before);
+		double start = now();
+		for (int i = 0; i < nops; i++) {
+			int hot = next_random() % 5 != 0;
+			int block = next_random() % (hot ? file_blocks / 5 : file_blocks);
+			double t = now();
+			fs_read(inumber, buffer, DISK_BLOCK_SIZE, block * DISK_BLOCK_SIZE);
+			record(now() - t);
+		}
+		double seconds = now() - start;
+		disk_stats(&after);
+		report("cachesweep", DISK_BLOCK_SIZE, nops, (long)nops * DISK_BLOCK_SIZE, seconds, &before, &after, extra);
+	}
+	close_fs();
+}
+
+static void usage( const char *program )
+{
+	fprintf(stderr, "use: %s [-i image] [-b nblocks] [-f file_blocks] [-n ops] [-t threads] [-l blocks|extents] [workload ...] [option=value ...]\n", program);
+	fprintf(stderr, "workloads: seq random churn durable mount cachesweep (all by default)\n");
+	fprintf(stderr, "options: the disk options of the shell; the image is overwritten and removed\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *workloads[8];
+	int nworkloads = 0;
+
+	disk_config_default(&config);
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] == '-' && i + 1 < argc && strlen(argv[i]) == 2) {
+			char *value = argv[++i];
+			switch (argv[i - 1][1]) {
+			case 'i': image = value; break;
+			case 'b': nblocks = atoi(value); break;
+			case 'f': file_blocks = atoi(value); break;
+			case 'n': nops = atoi(value); break;
+			case 't': nthreads = atoi(value); break;
+			case 'l': layout = strcmp(value, "extents") == 0 ? FS_LAYOUT_EXTENTS : FS_LAYOUT_BLOCKS; break;
+			default: usage(argv[0]); return 1;
+			}
+		} else if (strchr(argv[i], '=') != NULL) {
+			if (disk_config_set(&config, argv[i]) < 0) {
+				fprintf(stderr, "invalid disk option: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (argv[i][0] != '-' && nworkloads < 8) {
+			workloads[nworkloads++] = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nblocks <= 0 || file_blocks <= 0 || nops <= 0 || file_blocks > nblocks / 2 || nthreads <= 0 || nthreads > MAX_THREADS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// the JSON lines keep the standard output; what the disk and the file system print goes to the standard error
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	if (posix_memalign((void**)&buffer, DISK_BLOCK_SIZE, 256 * DISK_BLOCK_SIZE) != 0) {
+		return 1;
+	}
+	memset(buffer, 0x5a, 256 * DISK_BLOCK_SIZE);
+
+	static const struct {
+		const char *name;
+		void (*run)();
+	} all[] = {
+		{ "seq", bench_sequential },
+		{ "random", bench_random },
+		{ "churn", bench_churn },
+		{ "durable", bench_durable },
+		{ "mount", bench_mount },
+		{ "cachesweep", bench_cachesweep },
+	};
+	int nall = sizeof(all) / sizeof(all[0]);
+	for (int w = 0; w < nworkloads; w++) {
+		int known = 0;
+		for (int a = 0; a < nall; a++) {
+			known |= strcmp(workloads[w], all[a].name) == 0;
+		}
+		if (!known) {
+			fprintf(stderr, "unknown workload: %s\n", workloads[w]);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	for (int a = 0; a < nall; a++) {
+		int selected = nworkloads == 0;
+		for (int w = 0; w < nworkloads; w++) {
+			selected |= strcmp(workloads[w], all[a].name) == 0;
+		}
+		if (selected) {
+			all[a].run();
+		}
+	}
+	unlink(image);
+	fclose(out);
+	free(buffer);
+	free(latencies);
+	return 0;
+}
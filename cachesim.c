@@ -0,0 +1,293 @@
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*Cache simulator: replays a block access trace recorded with the trace disk option on caches of
+several sizes and policies, and prints the miss ratio of each one. The accesses go through the cache
+of disk.c itself, on the null backend, so the results are those of the real policies and sharding.
+The disk layer is one per process, so every configuration is replayed in a process of its own,
+several at a time.*/
+
+static const char *policy_names[] = { "random", "lru", "clock", "2q" };	// by CACHE_POLICY_*
+#define NPOLICIES (int)(sizeof(policy_names) / sizeof(policy_names[0]))
+
+static struct disk_trace_header header;
+static struct disk_trace_record *records;
+static int *order;	// the records in time order
+static long nrecords;
+
+/*Outcome of replaying the trace on one configuration.*/
+struct result {
+	int done;
+	long hits;
+	long misses;
+	long writebacks;	// dirty blocks evicted
+};
+
+static int compare_order( const void *a, const void *b )
+{
+	const struct disk_trace_record *x = &records[*(const int*)a], *y = &records[*(const int*)b];
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	// the blocks of a range access share their time; they keep the order they were recorded in
+	return *(const int*)a - *(const int*)b;
+}
+
+/*Reads the trace in filename and sorts its records by time. Returns 0 if success; -1 otherwise.*/
+static int load_trace( const char *filename )
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != DISK_TRACE_MAGIC || header.nblocks <= 0) {
+		fprintf(stderr, "%s is not a block access trace\n", filename);
+		close(fd);
+		return -1;
+	}
+	nrecords = (st.st_size - sizeof(header)) / sizeof(struct disk_trace_record);
+	records = malloc(nrecords * sizeof(struct disk_trace_record) + 1);
+	order = malloc(nrecords * sizeof(int) + 1);
+	size_t left = nrecords * sizeof(struct disk_trace_record);
+	char *data = (char*)records;
+	while (left > 0) {
+		ssize_t result = read(fd, data, left);
+		if (result <= 0) {
+			perror(filename);
+			close(fd);
+			return -1;
+		}
+		data += result;
+		left -= result;
+	}
+	close(fd);
+	for (long i = 0; i < nrecords; i++) {
+		if (records[i].blocknum < 0 || records[i].blocknum >= header.nblocks || records[i].type > DISK_TRACE_DISCARD) {
+			fprintf(stderr, "%s: record %ld is invalid\n", filename, i);
+			return -1;
+		}
+		order[i] = i;
+	}
+	qsort(order, nrecords, sizeof(int), compare_order);
+	return 0;
+}
+
+/*Replays the trace on a cache of cache_blocks blocks with the given policy and stores the outcome in result.
+Runs in a child process, since it opens the (null) disk.*/
+static void replay( struct disk_config config, int cache_blocks, int policy, struct result *result )
+{
+	static char buffer[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+
+	config.cache_blocks = cache_blocks;
+	config.cache_policy = policy;
+	config.backend = DISK_BACKEND_NULL;
+	config.trace_file[0] = '\0';
+	if (!disk_init_config("", header.nblocks, &config)) {
+		fprintf(stderr, "cannot simulate a cache of %d blocks\n", cache_blocks);
+		_exit(1);
+	}
+	for (long i = 0; i < nrecords; i++) {
+		const struct disk_trace_record *record = &records[order[i]];
+		if (record->type == DISK_TRACE_WRITE) {
+			disk_write_data(record->blocknum, buffer);
+		} else if (record->type == DISK_TRACE_DISCARD) {
+			disk_discard(record->blocknum, 1);
+		} else {
+			disk_read_data(record->blocknum, buffer);
+		}
+	}
+	struct disk_stats stats;
+	disk_stats(&stats);
+	result->hits = stats.hits;
+	result->misses = stats.misses;
+	result->writebacks = stats.evictions_dirty;
+	result->done = 1;
+	_exit(0);
+}
+
+/*Parses a comma separated list of cache sizes into sizes; returns how many there are, or -1 if invalid.*/
+static int parse_sizes( char *list, int *sizes, int max )
+{
+	int n = 0;
+	for (char *size = strtok(list, ","); size != NULL; size = strtok(NULL, ",")) {
+		if (n == max || atoi(size) <= 0) {
+			return -1;
+		}
+		sizes[n++] = atoi(size);
+	}
+	return n;
+}
+
+/*Parses a comma separated list of policy names into policies; returns how many there are, or -1 if invalid.*/
+static int parse_policies( char *list, int *policies )
+{
+	int n = 0;
+	for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		int id = 0;
+		while (id < NPOLICIES && strcmp(name, policy_names[id]) != 0) {
+			id++;
+		}
+		if (id == NPOLICIES || n == NPOLICIES) {
+			return -1;
+		}
+		policies[n++] = id;
+	}
+	return n;
+}
+
+static void usage( const char *program )
+{
+	fprintf(stderr, "use: %s [-s size,...] [-p policy,...] [-j jobs] <trace> [option=value ...]\n", program);
+	fprintf(stderr, "sizes: cache sizes in blocks (powers of two up to the blocks in the trace by default)\n");
+	fprintf(stderr, "policies: random lru clock 2q (all by default)\n");
+	fprintf(stderr, "options: the disk options of the shell, for instance shards=1 or readahead=32 (readahead=0 by default)\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	int sizes[64], nsizes = 0;
+	int policies[NPOLICIES], npolicies = 0;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *trace = NULL;
+	struct disk_config config;
+
+	disk_config_default(&config);
+	config.readahead = 0;
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] == '-' && i + 1 < argc && strlen(argv[i]) == 2) {
+			char *value = argv[++i];
+			switch (argv[i - 1][1]) {
+			case 's': nsizes = parse_sizes(value, sizes, 64); break;
+			case 'p': npolicies = parse_policies(value, policies); break;
+			case 'j': jobs = atoi(value); break;
+			default: usage(argv[0]); return 1;
+			}
+			if (nsizes < 0 || npolicies < 0 || jobs <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strchr(argv[i], '=') != NULL) {
+			if (disk_config_set(&config, argv[i]) < 0) {
+				fprintf(stderr, "invalid disk option: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (argv[i][0] != '-' && trace == NULL) {
+			trace = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (trace == NULL) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (load_trace(trace) < 0) {
+		return 1;
+	}
+
+	// no cache can avoid missing on the first access to a block, nor on the first one after it is discarded
+	unsigned char *seen = calloc(header.nblocks, 1);	// bit 0: accessed, bit 1: accessed since the last discard
+	long footprint = 0, compulsory = 0, reads = 0, writes = 0, discards = 0, recorded_misses = 0;
+	for (long i = 0; i < nrecords; i++) {
+		const struct disk_trace_record *record = &records[order[i]];
+		if (record->type == DISK_TRACE_DISCARD) {
+			seen[record->blocknum] &= ~2;
+			discards++;
+			continue;
+		}
+		footprint += !(seen[record->blocknum] & 1);
+		compulsory += !(seen[record->blocknum] & 2);
+		seen[record->blocknum] = 3;
+		reads += record->type == DISK_TRACE_READ;
+		writes += record->type == DISK_TRACE_WRITE;
+		recorded_misses += !record->hit;
+	}
+	free(seen);
+	long accesses = reads + writes;
+	if (nsizes == 0) {
+		for (long size = 16; nsizes < 64; size *= 2) {
+			sizes[nsizes++] = size < footprint ? size : footprint > 0 ? footprint : 1;
+			if (size >= footprint) {
+				break;
+			}
+		}
+	}
+	if (npolicies == 0) {
+		for (int id = 0; id < NPOLICIES; id++) {
+			policies[npolicies++] = id;
+		}
+	}
+
+	printf("%ld accesses (%ld reads, %ld writes) to %ld distinct blocks of a %d block disk, %ld blocks discarded\n",
+		accesses, reads, writes, footprint, header.nblocks, discards);
+	printf("recorded with a %s cache of %d blocks: miss ratio %.4f\n",
+		header.cache_policy >= 0 && header.cache_policy < NPOLICIES ? policy_names[header.cache_policy] : "unknown",
+		header.cache_blocks, accesses > 0 ? (double)recorded_misses / accesses : 0);
+	printf("compulsory miss ratio %.4f\n\n", accesses > 0 ? (double)compulsory / accesses : 0);
+	fflush(stdout);
+
+	// the children write their outcome in memory shared with the parent
+	int nconfigs = nsizes * npolicies;
+	struct result *results = mmap(NULL, nconfigs * sizeof(struct result), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	memset(results, 0, nconfigs * sizeof(struct result));
+	int running = 0;
+	for (int c = 0; c < nconfigs; c++) {
+		if (running == jobs) {
+			wait(NULL);
+			running--;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			// disk_close is not called, so the disk prints nothing; the errors go to the standard error
+			replay(config, sizes[c / npolicies], policies[c % npolicies], &results[c]);
+		}
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		running++;
+	}
+	while (running > 0) {
+		wait(NULL);
+		running--;
+	}
+
+	printf("miss ratio (blocks written back)\n%12s", "cache");
+	for (int p = 0; p < npolicies; p++) {
+		printf(" %21s", policy_names[policies[p]]);
+	}
+	printf("\n");
+	for (int s = 0; s < nsizes; s++) {
+		printf("%12d", sizes[s]);
+		for (int p = 0; p < npolicies; p++) {
+			const struct result *result = &results[s * npolicies + p];
+			if (!result->done) {
+				printf(" %21s", "failed");
+				continue;
+			}
+			long served = result->hits + result->misses;
+			printf(" %8.4f (%10ld)", served > 0 ? (double)result->misses / served : 0, result->writebacks);
+		}
+		printf("\n");
+	}
+	munmap(results, nconfigs * sizeof(struct result));
+	free(records);
+	free(order);
+	return 0;
+}
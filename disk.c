@@ -1,9 +1,19 @@
+#define _GNU_SOURCE	// O_DIRECT, MAP_HUGETLB, fallocate
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "disk.h"
 
@@ -12,68 +22,676 @@
 
 #define DISK_MAGIC 0xf0f03410
 
+// Number of blocks handled per call to read_vector/write_vector by the range functions
+#define RANGE_CHUNK 64
+
 #define FREE_BLOCK -1
 
-static FILE *diskfile;
+static int diskfd = -1;
+static int direct_io = 0;	// the image was opened with O_DIRECT
+
+// DISK_BACKEND_MMAP: the whole image is mapped and blocks are copied to/from the mapping
+static int backend = DISK_BACKEND_PREAD;
+static char* disk_map;
+static unsigned char* map_dirty;	// 1 for the blocks written through the mapping since the last msync
+static int map_dirty_first, map_dirty_last;	// range of blocks that may be dirty
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;	// protects the dirty map
 static int nblocks = 0;
-static int nreads = 0;
-static int nwrites = 0;
+static int flush_sync = 0;	// disk_flush ends with fdatasync
+
+/*Statistics, counted per thread in a disk_counter_set: struct disk_stats is made of longs only.*/
+static struct disk_counter_set stats_counters = DISK_COUNTER_SET_INIT(sizeof(struct disk_stats) / sizeof(long));
+static __thread struct disk_counter_slot my_counters;
+
+/*The counters of a thread, with the link of the list of their set before them.*/
+struct disk_counter_block {
+	struct disk_counter_block* next;
+	long counters[];
+};
+
+long* disk_counters(struct disk_counter_set* set, struct disk_counter_slot* slot) {
+	if (slot->counters == NULL || slot->generation != __atomic_load_n(&set->generation, __ATOMIC_ACQUIRE)) {
+		// whole cache lines, so that the counters of two threads never share one
+		size_t size = (sizeof(struct disk_counter_block) + set->n * sizeof(long) + 63) & ~(size_t)63;
+		void* memory;
+		if (posix_memalign(&memory, 64, size) != 0) {
+			printf("ERROR: couldn't allocate the counters: %s\n", strerror(errno));
+			abort();
+		}
+		struct disk_counter_block* block = (struct disk_counter_block*)memset(memory, 0, size);
+		pthread_mutex_lock(&set->lock);
+		block->next = set->all;
+		set->all = block;
+		slot->generation = set->generation;
+		pthread_mutex_unlock(&set->lock);
+		slot->counters = block->counters;
+	}
+	return slot->counters;
+}
+
+/*Adds the counters of all the threads of set to total. Called with the lock of set.*/
+static void add_counters(struct disk_counter_set* set, long* total) {
+	for (struct disk_counter_block* block = set->all; block != NULL; block = block->next) {
+		for (int i = 0; i < set->n; i++) {
+			total[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void disk_counters_sum(struct disk_counter_set* set, long* total, int since_reset) {
+	memset(total, 0, set->n * sizeof(long));
+	pthread_mutex_lock(&set->lock);
+	add_counters(set, total);
+	if (since_reset && set->base != NULL) {
+		for (int i = 0; i < set->n; i++) {
+			total[i] -= set->base[i];
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*The counters of the threads keep growing; what they had counted is subtracted from then on.*/
+void disk_counters_reset(struct disk_counter_set* set) {
+	pthread_mutex_lock(&set->lock);
+	if (set->base == NULL && (set->base = malloc(set->n * sizeof(long))) == NULL) {
+		printf("ERROR: couldn't allocate the counters: %s\n", strerror(errno));
+		abort();
+	}
+	memset(set->base, 0, set->n * sizeof(long));
+	add_counters(set, set->base);
+	pthread_mutex_unlock(&set->lock);
+}
+
+void disk_counters_free(struct disk_counter_set* set) {
+	pthread_mutex_lock(&set->lock);
+	while (set->all != NULL) {
+		struct disk_counter_block* next = set->all->next;
+		free(set->all);
+		set->all = next;
+	}
+	free(set->base);
+	set->base = NULL;
+	__atomic_add_fetch(&set->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&set->lock);
+}
+
+/*Adds n to a counter of disk_stats of the calling thread.*/
+#define COUNT(field, n) do { \
+	struct disk_stats* counters_ = (struct disk_stats*)disk_counters(&stats_counters, &my_counters); \
+	DISK_COUNTER_ADD(counters_->field, n); \
+} while (0)
+
+int disk_stats_bucket(unsigned long value, int nbuckets) {
+	int bucket = value == 0 ? 0 : 63 - __builtin_clzl(value);
+	return bucket < nbuckets ? bucket : nbuckets - 1;
+}
+
+/*Counts a batch of n dirty blocks written back.*/
+static void count_flush(int n) {
+	COUNT(flushes, 1);
+	COUNT(flush_blocks, n);
+	COUNT(flush_batch[disk_stats_bucket(n, DISK_STATS_BUCKETS)], 1);
+}
+
+/*Block access trace. Every thread fills a buffer of its own, which it appends to the trace file
+when it is full; disk_close writes what is left in all of them.*/
+#define TRACE_BUFFER_RECORDS 4096
+
+struct trace_buffer {
+	int nrecords;
+	struct disk_trace_record records[TRACE_BUFFER_RECORDS];
+	struct trace_buffer* next;
+};
+
+static int trace_fd = -1;	// the trace file, or -1 if the accesses are not traced
+static struct timespec trace_start;
+static struct trace_buffer* all_trace_buffers;	// the buffers of every thread that traced an access
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;	// protects all_trace_buffers and the file
+static int trace_generation = 0;	// changed by disk_close, which frees all_trace_buffers
+static __thread struct trace_buffer* my_trace;
+static __thread int my_trace_generation = -1;
+
+/*Appends the records of buffer to the trace file and empties it; trace_lock must be held.*/
+static void trace_write(struct trace_buffer* buffer) {
+	const char* data = (const char*)buffer->records;
+	size_t left = buffer->nrecords * sizeof(struct disk_trace_record);
+	while (left > 0) {
+		ssize_t result = write(trace_fd, data, left);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			printf("ERROR: couldn't write the trace: %s\n", strerror(errno));
+			break;
+		}
+		data += result;
+		left -= result;
+	}
+	buffer->nrecords = 0;
+}
+
+/*Records accesses to count blocks starting at blocknum in the buffer of the calling thread.*/
+static void trace_record(int blocknum, int count, int type, int hit) {
+	if (my_trace_generation != trace_generation) {
+		my_trace = (struct trace_buffer*)calloc(1, sizeof(struct trace_buffer));
+		if (my_trace == NULL) {
+			printf("ERROR: couldn't allocate the trace buffer: %s\n", strerror(errno));
+			abort();
+		}
+		pthread_mutex_lock(&trace_lock);
+		my_trace->next = all_trace_buffers;
+		all_trace_buffers = my_trace;
+		pthread_mutex_unlock(&trace_lock);
+		my_trace_generation = trace_generation;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long time = (now.tv_sec - trace_start.tv_sec) * 1000000000ULL + now.tv_nsec - trace_start.tv_nsec;
+	for (int i = 0; i < count; i++) {
+		if (my_trace->nrecords == TRACE_BUFFER_RECORDS) {
+			pthread_mutex_lock(&trace_lock);
+			trace_write(my_trace);
+			pthread_mutex_unlock(&trace_lock);
+		}
+		struct disk_trace_record* record = &my_trace->records[my_trace->nrecords++];
+		record->time = time;
+		record->blocknum = blocknum + i;
+		record->type = type;
+		record->hit = hit;
+		record->unused = 0;
+	}
+}
+
+/*Traces accesses of a DISK_TRACE_* type to count blocks starting at blocknum; when tracing is off it costs a test.*/
+#define TRACE(blocknum, count, type, hit) do { \
+	if (trace_fd >= 0) \
+		trace_record(blocknum, count, type, hit); \
+} while (0)
+
+/*Writes the header of a new trace, truncating the file. Returns 0 if success; -1 otherwise.*/
+static int trace_open(const char* filename, int cache_blocks, int cache_policy) {
+	trace_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (trace_fd < 0) {
+		return -1;
+	}
+	struct disk_trace_header header = { DISK_TRACE_MAGIC, nblocks, cache_blocks, cache_policy };
+	if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	return 0;
+}
+
+/*Writes what is left in the buffers of all the threads and closes the trace;
+the threads get new buffers if they trace accesses again.*/
+static void trace_close() {
+	pthread_mutex_lock(&trace_lock);
+	while (all_trace_buffers != NULL) {
+		struct trace_buffer* next = all_trace_buffers->next;
+		trace_write(all_trace_buffers);
+		free(all_trace_buffers);
+		all_trace_buffers = next;
+	}
+	trace_generation++;
+	close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
 
 // Data structures for the cache
 typedef struct __cache_memory {
 	char data[DISK_BLOCK_SIZE];
 } cache_memory;
 
-cache_memory* cache_data;	// cache data space
+cache_memory* cache_data;	// cache data space, page aligned
+static size_t cache_data_mapped;	// size of the mapping if cache_data was mmapped (huge pages), 0 otherwise
 
 #define FREE_BLOCK -1
 typedef struct __cache_entry {
 	int disk_block_number;  // identifies the block number in disk
 	int dirty_bit;   // this value is 1 if the block has been written, 0 otherwise
+	int refcount;    // number of disk_get_block users; pinned entries are never evicted
+	int readahead;   // 1 if the block was prefetched and has not been used yet
+	int ra_stream;   // stream that prefetched the block
+	int shard;       // shard the entry belongs to
+	long dirty_since;   // when the block became dirty (ms), for the writeback expiry
 	cache_memory* datab;    // a pointer to a disk data block cached in memory
 } cache_entry;
 
 cache_entry* cache;	// cache metadata
 
 static int cache_nblocks = 0;
-static int cachehits = 0;
-static int cachemisses = 0;
+
+#define NO_ENTRY -1
+
+/*Doubly linked list of cache entries; the head is the most recently inserted/used entry.
+Every entry is in at most one list, so all lists share the link arrays.*/
+struct entry_list {
+	int head;
+	int tail;
+	int size;
+};
+
+/*The cache is split in shards, each one with its own lock, entries, hash index, free entries and
+replacement state, so that threads using different blocks seldom wait for each other.
+A block always goes to the same shard; the I/O of a miss is done with the shard locked,
+so no other thread can see the entry before it is loaded.
+Operations on blocks of several shards lock them in increasing shard order.*/
+#define MAX_SHARDS 64	// sets of shards are bit masks
+#define SHARD_MIN_ENTRIES 16	// small caches get fewer shards, so each one still has a choice of victims
+#define SHARD_SPAN 16	// consecutive blocks that go to the same shard, so ranges and readahead lock few shards
+typedef uint64_t shard_set;
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	int first;	// the shard has the entries first..first+nentries-1
+	int nentries;
+	// Hash index from disk block number to cache entry (open addressing, linear probing)
+	int* index;	// cache entry number, or FREE_BLOCK if the bucket is empty
+	unsigned int index_mask;
+	// Stack of the entries that do not hold any block
+	int* free_entries;
+	int nfree_entries;
+	// State of the replacement policy
+	unsigned int seed;	// random
+	struct entry_list lru;	// lru
+	int clock_hand;	// clock
+	struct entry_list a1in, am;	// 2q
+	int a1in_max;
+	int* ghost_ring;
+	int ghost_max, ghost_first, ghost_size;
+	int* ghost_index;
+	unsigned int ghost_index_mask;
+} __attribute__((aligned(64)));
+
+static struct cache_shard* shards;
+static int nshards = 0;
+static int* free_entries;	// the free entry stacks of all the shards
+
+/*Interface of a cache replacement policy, which works on each shard separately.
+The policy is told about every block placed in, hit in and removed from the shard,
+and chooses the entry that entry_selection() evicts when the shard has no free entries.*/
+struct cache_policy {
+	const char* name;
+	void (*init)(struct cache_shard* shard);
+	void (*insert)(struct cache_shard* shard, int cacheIndex);	// a new block was placed at cacheIndex
+	void (*access)(struct cache_shard* shard, int cacheIndex);	// the block at cacheIndex was hit
+	void (*remove)(struct cache_shard* shard, int cacheIndex);	// the block at cacheIndex left the cache without being evicted
+	int (*victim)(struct cache_shard* shard, int clean_only);	// unlinks and returns the unpinned (and clean, if asked) entry to evict, -1 if none
+	void (*debug)(struct cache_shard* shard);
+	void (*close)(struct cache_shard* shard);
+};
+
+static const struct cache_policy* policy;
+static const struct cache_policy* policy_by_id(int id);
+static void policy_alloc();
+static void policy_free();
+
+static void (*flush_hook)() = NULL;
+static void (*writeback_hook)(long expire_ms, int background) = NULL;
+// Held while the flusher runs writeback_hook, so that disk_set_writeback_hook waits for the call to finish
+static pthread_mutex_t writeback_hook_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Sequential readahead: the last reads are grouped in streams of consecutive blocks;
+when a stream gets close to the end of what was prefetched for it, the next window of blocks is read
+with one I/O into clean cache entries. The window doubles while the prefetched blocks are used
+and halves when they are evicted unused.*/
+#define RA_STREAMS 8
+#define RA_MIN_WINDOW 4
+struct ra_stream {
+	int next_block;	// block expected by the next sequential read
+	int ra_end;	// first block not prefetched yet
+	int window;
+	int hits;	// prefetched blocks used since the last prefetch
+	unsigned int last_use;
+};
+static struct ra_stream ra_streams[RA_STREAMS];
+static unsigned int ra_clock = 0;
+static int ra_max_window = 0;	// 0 disables readahead
+// Protects the streams; it is taken with shard locks held, so no shard is locked while holding it
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Background writeback: a flusher thread cleans dirty entries when there are too many of them or
+they have been dirty for too long, so that eviction rarely has to write a block on the caller's time.*/
+#define WRITEBACK_BATCH 32	// blocks the flusher copies and writes per round
+static int ndirty = 0;	// number of dirty entries, updated atomically with the entry's shard locked
+static int writeback_enabled = 0;
+static pthread_t flusher;
+// Protects the flusher state below; no other lock is taken while holding it
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static int flusher_stop = 0;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writeback_done = PTHREAD_COND_INITIALIZER;	// a writeback round finished
+static int dirty_background;	// the flusher cleans dirty entries above this number...
+static int dirty_limit;	// ...and writers wait while there are this many
+static long dirty_expire_ms;	// and it cleans the entries dirty for longer than this
+static int writeback_inflight = 0;	// blocks copied by the flusher and not written yet (atomic)
+// Held by the flusher for a whole round and by disk_flush, so that disk_flush cannot miss the blocks
+// that the flusher copied and has not written yet; it is taken before any other lock
+static pthread_mutex_t writeback_round_lock = PTHREAD_MUTEX_INITIALIZER;
+static int writeback_progress = 0;	// blocks cleaned by the flusher's last round
+static int writeback_cursor = 0;	// cache entry where the flusher's next scan starts (flusher only)
+static __thread int is_flusher = 0;	// set in the flusher thread, which writeback_hook may make write
+static void* flusher_main(void* arg);
+
+/*Asynchronous requests: a queue of submitted requests, served by a pool of worker threads,
+and a queue of the completed requests that have no callback.*/
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;	// protects the queues and the pool
+static pthread_cond_t io_submitted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_completed = PTHREAD_COND_INITIALIZER;
+static struct disk_request *io_first, *io_last;	// submitted, not started
+static struct disk_request *done_first, *done_last;	// completed, not reaped
+static int io_unreaped = 0;	// requests without callback submitted and not reaped yet
+static int io_threads = 0;	// size of the pool
+static pthread_t* io_workers;	// the pool, NULL until the first submission
+static int io_stop = 0;
+
+
+/*Allocates a page-aligned arena of size bytes, with huge pages if asked and available,
+so that cached blocks can be used for direct I/O without bounce buffers.
+*mapped_size is set to the size of the mapping if the arena was mmapped, 0 otherwise.*/
+static void* alloc_arena(size_t size, int huge_pages, size_t* mapped_size) {
+	void* arena = NULL;
+	*mapped_size = 0;
+	if (huge_pages) {
+		size_t huge_size = (size + (2 << 20) - 1) & ~(size_t)((2 << 20) - 1);
+		arena = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (arena != MAP_FAILED) {
+			*mapped_size = huge_size;
+			return arena;
+		}
+		arena = NULL;
+	}
+	if (posix_memalign(&arena, sysconf(_SC_PAGESIZE), size > 0 ? size : 1) != 0) {
+		printf("ERROR: couldn't allocate the cache: %s\n", strerror(errno));
+		abort();
+	}
+#ifdef MADV_HUGEPAGE
+	if (huge_pages) {
+		madvise(arena, size, MADV_HUGEPAGE);	// no hugetlbfs pages; ask for transparent ones
+	}
+#endif
+	return arena;
+}
+
+static void free_arena(void* arena, size_t mapped_size) {
+	if (mapped_size > 0) {
+		munmap(arena, mapped_size);
+	} else {
+		free(arena);
+	}
+}
+
+void disk_config_default(struct disk_config* config) {
+	config->cache_policy = CACHE_POLICY_LRU;
+	config->direct_io = 0;
+	config->huge_pages = 0;
+	config->backend = DISK_BACKEND_PREAD;
+	config->cache_blocks = -1;
+	config->map_advice = DISK_ADVICE_NORMAL;
+	config->readahead = 32;
+	config->writeback = 0;
+	config->dirty_background = 10;
+	config->dirty_limit = 40;
+	config->dirty_expire = 3000;
+	config->flush_sync = 0;
+	config->cache_shards = 0;
+	config->io_threads = 4;
+	config->trace_file[0] = '\0';
+}
+
+/*Parses a non-negative integer option value; returns -1 if invalid.*/
+static int parse_count(const char* value) {
+	char* end;
+	long count = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || count < 0 || count > INT_MAX) {
+		return -1;
+	}
+	return (int)count;
+}
+
+/*Parses a 0/1 option value; returns -1 if invalid.*/
+static int parse_flag(const char* value) {
+	if (!strcmp(value, "0") || !strcmp(value, "1")) {
+		return value[0] - '0';
+	}
+	return -1;
+}
+
+int disk_config_set(struct disk_config* config, const char* option) {
+	const char* value = strchr(option, '=');
+	if (value == NULL) {
+		return -1;
+	}
+	value++;
+	if (!strncmp(option, "policy=", 7)) {
+		for (int id = 0; policy_by_id(id) != NULL; id++) {
+			if (!strcmp(value, policy_by_id(id)->name)) {
+				config->cache_policy = id;
+				return 0;
+			}
+		}
+	} else if (!strncmp(option, "direct=", 7) && parse_flag(value) >= 0) {
+		config->direct_io = parse_flag(value);
+		return 0;
+	} else if (!strncmp(option, "hugepages=", 10) && parse_flag(value) >= 0) {
+		config->huge_pages = parse_flag(value);
+		return 0;
+	} else if (!strncmp(option, "backend=", 8)) {
+		if (!strcmp(value, "pread")) {
+			config->backend = DISK_BACKEND_PREAD;
+			return 0;
+		} else if (!strcmp(value, "mmap")) {
+			config->backend = DISK_BACKEND_MMAP;
+			return 0;
+		} else if (!strcmp(value, "null")) {
+			config->backend = DISK_BACKEND_NULL;
+			return 0;
+		}
+	} else if (!strncmp(option, "trace=", 6) && *value != '\0' && strlen(value) < sizeof(config->trace_file)) {
+		strcpy(config->trace_file, value);
+		return 0;
+	} else if (!strncmp(option, "cache=", 6) && parse_count(value) >= 0) {
+		config->cache_blocks = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "io_threads=", 11) && parse_count(value) > 0) {
+		config->io_threads = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "shards=", 7) && parse_count(value) >= 0) {
+		config->cache_shards = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "readahead=", 10) && parse_count(value) >= 0) {
+		config->readahead = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "writeback=", 10) && parse_flag(value) >= 0) {
+		config->writeback = parse_flag(value);
+		return 0;
+	} else if (!strncmp(option, "dirty_background=", 17) && parse_count(value) >= 0 && parse_count(value) <= 100) {
+		config->dirty_background = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "dirty_limit=", 12) && parse_count(value) > 0 && parse_count(value) <= 100) {
+		config->dirty_limit = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "fsync=", 6) && parse_flag(value) >= 0) {
+		config->flush_sync = parse_flag(value);
+		return 0;
+	} else if (!strncmp(option, "dirty_expire=", 13) && parse_count(value) >= 0) {
+		config->dirty_expire = parse_count(value);
+		return 0;
+	} else if (!strncmp(option, "advice=", 7)) {
+		if (!strcmp(value, "normal")) {
+			config->map_advice = DISK_ADVICE_NORMAL;
+			return 0;
+		} else if (!strcmp(value, "sequential")) {
+			config->map_advice = DISK_ADVICE_SEQUENTIAL;
+			return 0;
+		} else if (!strcmp(value, "random")) {
+			config->map_advice = DISK_ADVICE_RANDOM;
+			return 0;
+		}
+	}
+	return -1;
+}
 
 int disk_init( const char *filename, int n ) {
-    diskfile = fopen( filename, "r+" );
-    if ( diskfile != NULL && n == -1 ) {
-        fseek( diskfile, 0L, SEEK_END );
-        n = ftell( diskfile );
-        fprintf( stderr, "filesize=%d, %d\n", n, n / DISK_BLOCK_SIZE );
-        n = n / DISK_BLOCK_SIZE;
+	struct disk_config config;
+	disk_config_default(&config);
+	return disk_init_config(filename, n, &config);
+}
+
+int disk_init_config( const char *filename, int n, const struct disk_config *config ) {
+    policy = policy_by_id(config->cache_policy);
+    if ( policy == NULL )
+        return 0;
+    if ( config->map_advice < DISK_ADVICE_NORMAL || config->map_advice > DISK_ADVICE_RANDOM ) {
+        fprintf( stderr, "invalid mmap advice %d\n", config->map_advice );
+        return 0;
+    }
+
+    backend = config->backend;
+    direct_io = config->direct_io;
+    if ( backend != DISK_BACKEND_PREAD && direct_io ) {
+        fprintf( stderr, "direct I/O only applies to the pread backend, ignored\n" );
+        direct_io = 0;
     }
-    if ( !diskfile )
-        diskfile = fopen( filename, "w+" );
-    if ( !diskfile )
+    if ( backend == DISK_BACKEND_NULL ) {
+        // there is no image, but diskfd keeps marking the disk as open
+        if ( n <= 0 )
+            return 0;
+        filename = "/dev/null";
+    }
+    diskfd = open( filename, O_RDWR | (backend != DISK_BACKEND_NULL ? O_CREAT : 0) | (direct_io ? O_DIRECT : 0), 0666 );
+    if ( diskfd < 0 && direct_io && errno == EINVAL ) {
+        // the file system of the image does not support direct I/O
+        fprintf( stderr, "O_DIRECT not supported for %s, using buffered I/O\n", filename );
+        direct_io = 0;
+        diskfd = open( filename, O_RDWR | O_CREAT, 0666 );
+    }
+    if ( diskfd < 0 )
         return 0;
+    if ( n == -1 ) {
+        struct stat st;
+        fstat( diskfd, &st );
+        n = st.st_size / DISK_BLOCK_SIZE;
+        fprintf( stderr, "filesize=%ld, %d\n", (long)st.st_size, n );
+    }
+
+    if ( backend != DISK_BACKEND_NULL && ftruncate( diskfd, (off_t)n * DISK_BLOCK_SIZE ) < 0 )
+        perror( "disk_init truncate" );
 
-    ftruncate( fileno( diskfile ), n * DISK_BLOCK_SIZE );
+    if ( backend == DISK_BACKEND_MMAP ) {
+        disk_map = mmap( NULL, (size_t)n * DISK_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, diskfd, 0 );
+        if ( disk_map == MAP_FAILED ) {
+            disk_map = NULL;
+            close( diskfd );
+            diskfd = -1;
+            return 0;
+        }
+        static const int advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM };
+        madvise( disk_map, (size_t)n * DISK_BLOCK_SIZE, advice[config->map_advice] );
+        map_dirty = (unsigned char*)calloc( n > 0 ? n : 1, sizeof(unsigned char) );
+        map_dirty_first = n;
+        map_dirty_last = -1;
+    }
 
     nblocks = n;
-    nreads = 0;
-    nwrites = 0;
+    flush_sync = config->flush_sync;
+    io_threads = config->io_threads;
 
-	cache_nblocks = (int)ceil((float)nblocks * 0.2);
+	if (config->cache_blocks >= 0) {
+		cache_nblocks = config->cache_blocks < nblocks ? config->cache_blocks : nblocks;
+	} else {
+		cache_nblocks = (int)ceil((float)nblocks * 0.2);
+	}
+	nshards = config->cache_shards > 0 ? config->cache_shards : cache_nblocks / SHARD_MIN_ENTRIES;
+	if (nshards > MAX_SHARDS) {
+		nshards = MAX_SHARDS;
+	}
+	if (nshards > cache_nblocks) {
+		nshards = cache_nblocks;
+	}
+	if (nshards < 1 && cache_nblocks > 0) {
+		nshards = 1;
+	}
   	cache = (cache_entry*)malloc(sizeof(cache_entry) * cache_nblocks);
-  	cache_data = (cache_memory*)malloc(sizeof(cache_memory) * cache_nblocks);
+	cache_data = (cache_memory*)alloc_arena(sizeof(cache_memory) * cache_nblocks, config->huge_pages, &cache_data_mapped);
+	free_entries = (int*)malloc(sizeof(int) * (cache_nblocks > 0 ? cache_nblocks : 1));
+	void* shard_memory = NULL;
+	if (posix_memalign(&shard_memory, 64, sizeof(struct cache_shard) * (nshards > 0 ? nshards : 1)) != 0) {
+		printf("ERROR: couldn't allocate the cache: %s\n", strerror(errno));
+		abort();
+	}
+	shards = (struct cache_shard*)shard_memory;
+	policy_alloc();
+
+	for (int s = 0; s < nshards; s++) {
+		struct cache_shard* shard = &shards[s];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->first = (int)((long)cache_nblocks * s / nshards);
+		shard->nentries = (int)((long)cache_nblocks * (s + 1) / nshards) - shard->first;
+
+		// the index has at least twice as many buckets as entries, so probe sequences stay short
+		unsigned int nbuckets = 2;
+		while (nbuckets < 2 * (unsigned int)shard->nentries) {
+			nbuckets <<= 1;
+		}
+		shard->index_mask = nbuckets - 1;
+		shard->index = (int*)malloc(sizeof(int) * nbuckets);
+		for (unsigned int i = 0; i < nbuckets; i++) {
+			shard->index[i] = FREE_BLOCK;
+		}
+		shard->free_entries = free_entries + shard->first;
+		shard->nfree_entries = 0;
+
+		for (int i = shard->first + shard->nentries - 1; i >= shard->first; i--) {
+			cache[i].disk_block_number = FREE_BLOCK;
+			cache[i].dirty_bit = 0;
+			cache[i].refcount = 0;
+			cache[i].readahead = 0;
+			cache[i].shard = s;
+			cache[i].datab = &cache_data[i];
+			shard->free_entries[shard->nfree_entries++] = i;
+		}
+		policy->init(shard);
+	}
+
+	// readahead may use at most a quarter of the cache per prefetch
+	ra_max_window = config->readahead < cache_nblocks / 4 ? config->readahead : cache_nblocks / 4;
+	if (ra_max_window < RA_MIN_WINDOW) {
+		ra_max_window = 0;
+	}
+	memset(ra_streams, 0, sizeof(ra_streams));
+	for (int i = 0; i < RA_STREAMS; i++) {
+		ra_streams[i].next_block = FREE_BLOCK;
+	}
+
+	ndirty = 0;
+	writeback_enabled = config->writeback && cache_nblocks > 0;
+	if (writeback_enabled) {
+		dirty_background = cache_nblocks * config->dirty_background / 100;
+		dirty_limit = cache_nblocks * config->dirty_limit / 100;
+		if (dirty_limit < 1) {
+			dirty_limit = 1;
+		}
+		dirty_expire_ms = config->dirty_expire;
+		flusher_stop = 0;
+		writeback_inflight = 0;
+		writeback_cursor = 0;
+		if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+			writeback_enabled = 0;
+		}
+	}
 
-	for(int i = 0; i < cache_nblocks; i++) {
-		cache[i].disk_block_number = FREE_BLOCK;
-		cache[i].datab = &cache_data[i];
+	if (config->trace_file[0] != '\0' && trace_open(config->trace_file, cache_nblocks, config->cache_policy) < 0) {
+		fprintf(stderr, "couldn't create the trace %s: %s, not tracing\n", config->trace_file, strerror(errno));
 	}
 
 #ifdef DEBUG
     printf( "Cache blocks %d\n", cache_nblocks );
 #endif
 
-
-    srand( 0 );	// to generate always the same sequence of blocks to evict
-
     return 1;
 }
 
@@ -98,178 +716,1715 @@ static void sanity_check( int blocknum, const void *data ) {
     }
 }
 
+/*Returns the shard of the cache where blocknum goes.*/
+static struct cache_shard* shard_for_block(int blocknum) {
+	return &shards[(blocknum / SHARD_SPAN) % nshards];
+}
+
+/*Returns the set of all the shards.*/
+static shard_set all_shards() {
+	return nshards == MAX_SHARDS ? ~(shard_set)0 : ((shard_set)1 << nshards) - 1;
+}
+
+/*Returns the set of the shards of count consecutive blocks starting at blocknum.*/
+static shard_set shards_of_range(int blocknum, int count) {
+	shard_set set = 0;
+	if (nshards == 0) {
+		return set;
+	}
+	for (int block = blocknum; block < blocknum + count && set != all_shards(); block = (block / SHARD_SPAN + 1) * SHARD_SPAN) {
+		set |= (shard_set)1 << (shard_for_block(block) - shards);
+	}
+	return set;
+}
+
+/*Returns the set of the shards of blocknums[0..count-1].*/
+static shard_set shards_of_blocks(const int* blocknums, int count) {
+	shard_set set = 0;
+	for (int i = 0; i < count && nshards > 0; i++) {
+		set |= (shard_set)1 << (shard_for_block(blocknums[i]) - shards);
+	}
+	return set;
+}
+
+/*Locks the shards of set, in increasing order so that two threads cannot deadlock.*/
+static void lock_shards(shard_set set) {
+	while (set != 0) {
+		pthread_mutex_lock(&shards[__builtin_ctzll(set)].lock);
+		set &= set - 1;
+	}
+}
+
+static void unlock_shards(shard_set set) {
+	while (set != 0) {
+		pthread_mutex_unlock(&shards[__builtin_ctzll(set)].lock);
+		set &= set - 1;
+	}
+}
+
+/*Returns the bucket of the shard's index where the search for blocknum starts.*/
+static unsigned int index_bucket(struct cache_shard* shard, int blocknum) {
+	return ((unsigned int)blocknum * 2654435761u) & shard->index_mask;
+}
+
 /* Searches the cache for a block; returns its position in the cache or -1 otherwise
 
 Returns the index of a cache_entry in cache with a matching blocknum,
--1 if there's no such entry in the cache
-(If blockNum == -1 then this function will search for a free entry in cache).*/
-int search_cache(int data_block_num)
+-1 if there's no such entry in the cache. The block's shard must be locked.*/
+int search_cache(struct cache_shard* shard, int data_block_num)
 {
-	int entry_num = 0;
-	while (entry_num < cache_nblocks) {
-		if (cache[entry_num++].disk_block_number == data_block_num) {
-			return --entry_num;
+	unsigned int bucket = index_bucket(shard, data_block_num);
+	while (shard->index[bucket] != FREE_BLOCK) {
+		if (cache[shard->index[bucket]].disk_block_number == data_block_num) {
+			return shard->index[bucket];
 		}
+		bucket = (bucket + 1) & shard->index_mask;
 	}
 	return -1;
 }
 
-/*Writes data from the cache at cacheIndex in the given buffer.*/
-void writeFromCacheToBuffer(int cacheIndex, char* buffer) {
-	for (size_t i = 0; i < DISK_BLOCK_SIZE; i++) {
-		buffer[i] = cache[cacheIndex].datab->data[i];
+/*Registers the cache entry at cacheIndex in the shard's index.*/
+static void index_insert(struct cache_shard* shard, int cacheIndex) {
+	unsigned int bucket = index_bucket(shard, cache[cacheIndex].disk_block_number);
+	while (shard->index[bucket] != FREE_BLOCK) {
+		bucket = (bucket + 1) & shard->index_mask;
 	}
+	shard->index[bucket] = cacheIndex;
 }
 
-/*Writes data from the given buffer in the cache at cacheIndex.*/
-void writeFromBufferToCache(int cacheIndex, const char* buffer) {
-	cache[cacheIndex].dirty_bit = 1;
-	for (size_t i = 0; i < DISK_BLOCK_SIZE; i++) {
-		cache[cacheIndex].datab->data[i] = buffer[i];
+/*Removes the cache entry at cacheIndex from the shard's index.
+The entries that follow it in the probe sequence are shifted back, so no tombstones are needed.*/
+static void index_remove(struct cache_shard* shard, int cacheIndex) {
+	unsigned int hole = index_bucket(shard, cache[cacheIndex].disk_block_number);
+	while (shard->index[hole] != cacheIndex) {
+		hole = (hole + 1) & shard->index_mask;
+	}
+	unsigned int bucket = hole;
+	while (1) {
+		bucket = (bucket + 1) & shard->index_mask;
+		if (shard->index[bucket] == FREE_BLOCK) {
+			break;
+		}
+		unsigned int home = index_bucket(shard, cache[shard->index[bucket]].disk_block_number);
+		// the entry may fill the hole only if its home bucket is not between the hole and it
+		if (((bucket - home) & shard->index_mask) >= ((bucket - hole) & shard->index_mask)) {
+			shard->index[hole] = shard->index[bucket];
+			hole = bucket;
+		}
 	}
+	shard->index[hole] = FREE_BLOCK;
 }
 
-/*Sets a new entry in cache at cacheIndex for the block at blocknum in disk.*/
-void setNewCacheEntry(int cacheIndex, int blocknum) {
-	cache[cacheIndex].dirty_bit = 0;
-	cache[cacheIndex].disk_block_number = blocknum;
+/**************************************************************/
+/* Replacement policies */
+
+// Number of entries, from the cold end, searched for a clean victim before a dirty one is evicted
+#define VICTIM_SCAN_LIMIT 16
+
+// Per entry state of the policies, for the whole cache (each entry belongs to one shard)
+static int* list_prev;
+static int* list_next;
+static unsigned char* clock_ref;
+static unsigned char* in_am;	// 2q: 1 if the entry is in am, 0 if it is in a1in
+
+static void policy_alloc() {
+	list_prev = (int*)malloc(sizeof(int) * (cache_nblocks > 0 ? cache_nblocks : 1));
+	list_next = (int*)malloc(sizeof(int) * (cache_nblocks > 0 ? cache_nblocks : 1));
+	clock_ref = (unsigned char*)calloc(cache_nblocks > 0 ? cache_nblocks : 1, sizeof(unsigned char));
+	in_am = (unsigned char*)calloc(cache_nblocks > 0 ? cache_nblocks : 1, sizeof(unsigned char));
 }
-int entry_selection();
 
-/*Flushes the contents of a cache block at cacheIndex into disk*/
-void disk_flush_block(int cacheIndex) {
-	disk_write(cache[cacheIndex].disk_block_number, cache[cacheIndex].datab->data);
-	cache[cacheIndex].dirty_bit = 0;
+static void policy_free() {
+	free(list_prev);
+	free(list_next);
+	free(clock_ref);
+	free(in_am);
 }
 
-/*Sets a new entry in cache for the block at blocknum in disk.
-Returns the cacheIndex in which the new entry was stored.*/
-int setNewEntryForBlock(int blocknum) {
-	int cacheIndex = entry_selection();
-	setNewCacheEntry(cacheIndex, blocknum);
-	return cacheIndex;
+static void list_init(struct entry_list* list) {
+	list->head = NO_ENTRY;
+	list->tail = NO_ENTRY;
+	list->size = 0;
 }
 
-void disk_read( int blocknum, char *data ) {
-    sanity_check( blocknum, data );
+static void list_push_head(struct entry_list* list, int cacheIndex) {
+	list_prev[cacheIndex] = NO_ENTRY;
+	list_next[cacheIndex] = list->head;
+	if (list->head != NO_ENTRY) {
+		list_prev[list->head] = cacheIndex;
+	} else {
+		list->tail = cacheIndex;
+	}
+	list->head = cacheIndex;
+	list->size++;
+}
 
-    if ( fseek( diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET )<0 )
-        perror("disk_read seek");
+static void list_unlink(struct entry_list* list, int cacheIndex) {
+	if (list_prev[cacheIndex] != NO_ENTRY) {
+		list_next[list_prev[cacheIndex]] = list_next[cacheIndex];
+	} else {
+		list->head = list_next[cacheIndex];
+	}
+	if (list_next[cacheIndex] != NO_ENTRY) {
+		list_prev[list_next[cacheIndex]] = list_prev[cacheIndex];
+	} else {
+		list->tail = list_prev[cacheIndex];
+	}
+	list->size--;
+}
 
-    if (fread( data, DISK_BLOCK_SIZE, 1, diskfile ) == 1) {
-        nreads++;
-    } else {
-        printf( "ERROR: couldn't access simulated disk: %s\n",
-                strerror( errno ) );
-        abort();
-    }
+/*Returns the first clean entry among the VICTIM_SCAN_LIMIT coldest unpinned entries of the list,
+or (unless clean_only) its coldest unpinned entry if they are all dirty; NO_ENTRY if there is none.*/
+static int list_clean_victim(struct entry_list* list, int clean_only) {
+	int coldest = NO_ENTRY;
+	int scanned = 0;
+	for (int cacheIndex = list->tail; cacheIndex != NO_ENTRY; cacheIndex = list_prev[cacheIndex]) {
+		if (cache[cacheIndex].refcount > 0) {
+			continue;
+		}
+		if (!cache[cacheIndex].dirty_bit) {
+			return cacheIndex;
+		}
+		if (coldest == NO_ENTRY) {
+			coldest = cacheIndex;
+		}
+		if (++scanned == VICTIM_SCAN_LIMIT) {
+			break;
+		}
+	}
+	return clean_only ? NO_ENTRY : coldest;
 }
 
-void disk_write( int blocknum, const char *data ) {
-#ifdef DEBUG
-    printf( "Writing block %d\n", blocknum );
-#endif
-    sanity_check( blocknum, data );
+/* RANDOM: evicts a random entry */
 
-    if ( fseek( diskfile, blocknum * DISK_BLOCK_SIZE, SEEK_SET )<0 )
-        perror("disk_write seek");
+static void random_init(struct cache_shard* shard) {
+	shard->seed = shard - shards;	// to generate always the same sequence of blocks to evict
+}
 
-    if ( fwrite( data, DISK_BLOCK_SIZE, 1, diskfile ) == 1) {
-        nwrites++;
-    } else {
-        printf( "ERROR: couldn't access simulated disk: %s\n",
-                strerror( errno ) );
-        abort();
-    }
+static void random_nop(struct cache_shard* shard, int cacheIndex) {
 }
 
-// allocates a cache_entry where to place the new block
-int entry_selection()
-{
-	// TODO
-	// note: the function rand() generates a random number
-	int entry_num = search_cache(FREE_BLOCK);
-	if (entry_num == -1) {
-		entry_num = rand() % cache_nblocks;
-		if (cache[entry_num].dirty_bit == 1) {
-			disk_flush_block(entry_num);
+static int random_victim(struct cache_shard* shard, int clean_only) {
+	// note: the function rand_r() generates a random number
+	int entry_num = NO_ENTRY;
+	for (int i = 0; i < VICTIM_SCAN_LIMIT; i++) {
+		int candidate = shard->first + rand_r(&shard->seed) % shard->nentries;
+		if (cache[candidate].refcount == 0 && (!clean_only || !cache[candidate].dirty_bit)) {
+			entry_num = candidate;
+			if (!cache[candidate].dirty_bit) {
+				break;
+			}
+		}
+	}
+	if (clean_only) {
+		return entry_num;
+	}
+	// unlucky draws: takes the next unpinned entry
+	for (int i = shard->first; entry_num == NO_ENTRY && i < shard->first + shard->nentries; i++) {
+		if (cache[i].refcount == 0) {
+			entry_num = i;
 		}
-		cache[entry_num].disk_block_number = -1;
 	}
 	return entry_num;
 }
 
-// Cache aware read
-void disk_read_data( int blocknum, char *data ) {
- 	sanity_check( blocknum, data );
-	int cacheIndex;
-#ifdef DEBUG
-    printf( "disk_read_data for block %d \n", blocknum );
-#endif
+static void random_debug(struct cache_shard* shard) {
+}
 
-	cacheIndex = search_cache(blocknum);
-	if (cacheIndex == -1) {
-		cachemisses++;
-		cacheIndex = setNewEntryForBlock(blocknum);
-		disk_read(blocknum, cache[cacheIndex].datab->data);
-	} else {
-		cachehits++;
+static void random_close(struct cache_shard* shard) {
+}
+
+/* LRU: evicts the least recently used entry */
+
+static void lru_init(struct cache_shard* shard) {
+	list_init(&shard->lru);
+}
+
+static void lru_insert(struct cache_shard* shard, int cacheIndex) {
+	list_push_head(&shard->lru, cacheIndex);
+}
+
+static void lru_access(struct cache_shard* shard, int cacheIndex) {
+	list_unlink(&shard->lru, cacheIndex);
+	list_push_head(&shard->lru, cacheIndex);
+}
+
+static void lru_remove(struct cache_shard* shard, int cacheIndex) {
+	list_unlink(&shard->lru, cacheIndex);
+}
+
+static int lru_victim(struct cache_shard* shard, int clean_only) {
+	int cacheIndex = list_clean_victim(&shard->lru, clean_only);
+	if (cacheIndex == NO_ENTRY) {
+		return NO_ENTRY;
 	}
-	writeFromCacheToBuffer(cacheIndex, data);
+	list_unlink(&shard->lru, cacheIndex);
+	return cacheIndex;
 }
 
-// Cache aware write
-void disk_write_data(int blocknum, const char* data) {
-	sanity_check( blocknum, data );
+static void lru_debug(struct cache_shard* shard) {
+	printf("	lru: %d entries, mru block %d, lru block %d\n", shard->lru.size,
+		shard->lru.head == NO_ENTRY ? FREE_BLOCK : cache[shard->lru.head].disk_block_number,
+		shard->lru.tail == NO_ENTRY ? FREE_BLOCK : cache[shard->lru.tail].disk_block_number);
+}
 
-#ifdef DEBUG
-	printf( "disk_write_data for block %d \n", blocknum );
-#endif
-	int cacheIndex = search_cache(blocknum);
-	if (cacheIndex == -1) {
-		cachemisses++;
-		cacheIndex = setNewEntryForBlock(blocknum);
-	} else {
-		cachehits++;
+static void lru_close(struct cache_shard* shard) {
+}
+
+/* CLOCK: second chance with one reference bit per entry */
+
+static void clock_init(struct cache_shard* shard) {
+	shard->clock_hand = shard->first;
+}
+
+static void clock_insert(struct cache_shard* shard, int cacheIndex) {
+	clock_ref[cacheIndex] = 1;
+}
+
+static void clock_access(struct cache_shard* shard, int cacheIndex) {
+	clock_ref[cacheIndex] = 1;
+}
+
+static void clock_remove(struct cache_shard* shard, int cacheIndex) {
+	clock_ref[cacheIndex] = 0;
+}
+
+static int clock_victim(struct cache_shard* shard, int clean_only) {
+	// Entries without a second chance are evicted only if clean on the first two turns of the hand;
+	// after that the first one found (possibly dirty) is taken.
+	int firstDirty = NO_ENTRY;
+	for (int step = 0; step < 2 * shard->nentries; step++) {
+		int cacheIndex = shard->clock_hand;
+		shard->clock_hand = cacheIndex + 1 < shard->first + shard->nentries ? cacheIndex + 1 : shard->first;
+		if (cache[cacheIndex].refcount > 0) {
+			continue;
+		} else if (clock_ref[cacheIndex]) {
+			clock_ref[cacheIndex] = 0;
+		} else if (!cache[cacheIndex].dirty_bit) {
+			return cacheIndex;
+		} else if (firstDirty == NO_ENTRY) {
+			firstDirty = cacheIndex;
+		}
 	}
-	writeFromBufferToCache(cacheIndex, data);
+	return clean_only ? NO_ENTRY : firstDirty;
 }
 
-// Writes the cache's metadata
-void cache_debug() {
-	for( int i = 0; i < cache_nblocks; i++ ) {
-    	// TODO
-		printf("Cache block: %d\n", i);
-		printf("	disk_block_number: %d\n", cache[i].disk_block_number);
-		printf("	dirty_bit: %d\n", cache[i].dirty_bit);
-		//printf("	datab: %d\n\n", &cache->datab);
+static void clock_debug(struct cache_shard* shard) {
+	int nref = 0;
+	for (int i = shard->first; i < shard->first + shard->nentries; i++) {
+		nref += clock_ref[i];
 	}
+	printf("	clock: hand at entry %d, %d entries referenced\n", shard->clock_hand, nref);
 }
 
+static void clock_close(struct cache_shard* shard) {
+}
 
-// flushes the modified data blocks to disk
-void disk_flush() {
-	for (size_t cacheIndex = 0; cacheIndex < cache_nblocks; cacheIndex++) {
-		if (cache[cacheIndex].dirty_bit == 1) {
-			disk_flush_block(cacheIndex);
+/* 2Q (Johnson & Shasha): new blocks enter the FIFO a1in; blocks referenced again
+after leaving it (remembered in the ghost queue a1out) are promoted to the LRU am.
+A scan only goes through a1in, so it cannot flush the hot blocks in am.
+a1in is reclaimed first when it is bigger than a1in_max (Kin); a1out is a ring of the block numbers
+last evicted from a1in, plus a hash set (ghost_index) to look them up. */
+
+static unsigned int ghost_bucket(struct cache_shard* shard, int blocknum) {
+	return ((unsigned int)blocknum * 2654435761u) & shard->ghost_index_mask;
+}
+
+static int ghost_find(struct cache_shard* shard, int blocknum) {
+	unsigned int bucket = ghost_bucket(shard, blocknum);
+	while (shard->ghost_index[bucket] != NO_ENTRY) {
+		if (shard->ghost_ring[shard->ghost_index[bucket]] == blocknum) {
+			return bucket;
 		}
+		bucket = (bucket + 1) & shard->ghost_index_mask;
 	}
+	return NO_ENTRY;
 }
 
+static void ghost_forget(struct cache_shard* shard, unsigned int hole) {
+	unsigned int bucket = hole;
+	while (1) {
+		bucket = (bucket + 1) & shard->ghost_index_mask;
+		if (shard->ghost_index[bucket] == NO_ENTRY) {
+			break;
+		}
+		unsigned int home = ghost_bucket(shard, shard->ghost_ring[shard->ghost_index[bucket]]);
+		if (((bucket - home) & shard->ghost_index_mask) >= ((bucket - hole) & shard->ghost_index_mask)) {
+			shard->ghost_index[hole] = shard->ghost_index[bucket];
+			hole = bucket;
+		}
+	}
+	shard->ghost_index[hole] = NO_ENTRY;
+}
 
-void disk_close( ) {
-	if (diskfile)  {
-		// TODO: flushes the cache and frees the allocated memory
-		disk_flush();
+static void ghost_remember(struct cache_shard* shard, int blocknum) {
+	if (shard->ghost_max == 0) {
+		return;
+	}
+	if (shard->ghost_size == shard->ghost_max) {
+		int oldest = ghost_find(shard, shard->ghost_ring[shard->ghost_first]);
+		if (oldest != NO_ENTRY && shard->ghost_index[oldest] == shard->ghost_first) {
+			ghost_forget(shard, oldest);
+		}
+		shard->ghost_first = (shard->ghost_first + 1) % shard->ghost_max;
+		shard->ghost_size--;
+	}
+	int position = (shard->ghost_first + shard->ghost_size++) % shard->ghost_max;
+	shard->ghost_ring[position] = blocknum;
+	unsigned int bucket = ghost_bucket(shard, blocknum);
+	while (shard->ghost_index[bucket] != NO_ENTRY) {
+		bucket = (bucket + 1) & shard->ghost_index_mask;
+	}
+	shard->ghost_index[bucket] = position;
+}
+
+static void twoq_init(struct cache_shard* shard) {
+	list_init(&shard->a1in);
+	list_init(&shard->am);
+	shard->a1in_max = shard->nentries / 4 > 0 ? shard->nentries / 4 : 1;
+	shard->ghost_max = shard->nentries / 2;
+	shard->ghost_ring = (int*)malloc(sizeof(int) * (shard->ghost_max > 0 ? shard->ghost_max : 1));
+	shard->ghost_first = 0;
+	shard->ghost_size = 0;
+	unsigned int nbuckets = 2;
+	while (nbuckets < 2 * (unsigned int)shard->ghost_max) {
+		nbuckets <<= 1;
+	}
+	shard->ghost_index_mask = nbuckets - 1;
+	shard->ghost_index = (int*)malloc(sizeof(int) * nbuckets);
+	for (unsigned int i = 0; i < nbuckets; i++) {
+		shard->ghost_index[i] = NO_ENTRY;
+	}
+}
+
+static void twoq_insert(struct cache_shard* shard, int cacheIndex) {
+	// The ring slot of a forgotten block is left in place; it is dropped when the ring wraps
+	int bucket = ghost_find(shard, cache[cacheIndex].disk_block_number);
+	if (bucket != NO_ENTRY) {
+		shard->ghost_ring[shard->ghost_index[bucket]] = FREE_BLOCK;
+		ghost_forget(shard, bucket);
+		in_am[cacheIndex] = 1;
+		list_push_head(&shard->am, cacheIndex);
+	} else {
+		in_am[cacheIndex] = 0;
+		list_push_head(&shard->a1in, cacheIndex);
+	}
+}
+
+static void twoq_access(struct cache_shard* shard, int cacheIndex) {
+	// hits in a1in are treated as correlated references and do not promote the block
+	if (in_am[cacheIndex]) {
+		list_unlink(&shard->am, cacheIndex);
+		list_push_head(&shard->am, cacheIndex);
+	}
+}
+
+static void twoq_remove(struct cache_shard* shard, int cacheIndex) {
+	list_unlink(in_am[cacheIndex] ? &shard->am : &shard->a1in, cacheIndex);
+}
+
+static int twoq_victim(struct cache_shard* shard, int clean_only) {
+	struct entry_list* first = (shard->a1in.size > shard->a1in_max || shard->am.size == 0) ? &shard->a1in : &shard->am;
+	struct entry_list* second = first == &shard->a1in ? &shard->am : &shard->a1in;
+	int cacheIndex = list_clean_victim(first, clean_only);
+	if (cacheIndex == NO_ENTRY || cache[cacheIndex].dirty_bit) {
+		int other = list_clean_victim(second, clean_only);
+		if (other != NO_ENTRY && (cacheIndex == NO_ENTRY || !cache[other].dirty_bit)) {
+			first = second;
+			cacheIndex = other;
+		}
+	}
+	if (cacheIndex == NO_ENTRY) {
+		return NO_ENTRY;
+	}
+	list_unlink(first, cacheIndex);
+	if (first == &shard->a1in) {
+		ghost_remember(shard, cache[cacheIndex].disk_block_number);
+	}
+	return cacheIndex;
+}
+
+static void twoq_debug(struct cache_shard* shard) {
+	printf("	2q: a1in %d/%d entries, am %d entries, a1out %d/%d blocks\n",
+		shard->a1in.size, shard->a1in_max, shard->am.size, shard->ghost_size, shard->ghost_max);
+}
+
+static void twoq_close(struct cache_shard* shard) {
+	free(shard->ghost_ring);
+	free(shard->ghost_index);
+}
+
+static const struct cache_policy cache_policies[] = {
+	[CACHE_POLICY_RANDOM] = { "random", random_init, random_nop, random_nop, random_nop, random_victim, random_debug, random_close },
+	[CACHE_POLICY_LRU] = { "lru", lru_init, lru_insert, lru_access, lru_remove, lru_victim, lru_debug, lru_close },
+	[CACHE_POLICY_CLOCK] = { "clock", clock_init, clock_insert, clock_access, clock_remove, clock_victim, clock_debug, clock_close },
+	[CACHE_POLICY_2Q] = { "2q", twoq_init, twoq_insert, twoq_access, twoq_remove, twoq_victim, twoq_debug, twoq_close },
+};
+
+static const struct cache_policy* policy_by_id(int id) {
+	if (id < 0 || id >= (int)(sizeof(cache_policies) / sizeof(cache_policies[0]))) {
+		return NULL;
+	}
+	return &cache_policies[id];
+}
+
+/**************************************************************/
+
+/* Background writeback */
+
+static int transfer_run( int blocknum, int count, char *const *buffers, int write );
+static void map_mark_dirty( int blocknum, int count );
+
+// Block numbers that compare_blocks sorts indices by; the flusher sorts without holding any lock,
+// so it uses its own array
+static __thread const int* sort_blocks;
+
+/*qsort comparator of indices into sort_blocks, in increasing block number.*/
+static int compare_blocks(const void* a, const void* b) {
+	int blockA = sort_blocks[*(const int*)a];
+	int blockB = sort_blocks[*(const int*)b];
+	return (blockA > blockB) - (blockA < blockB);
+}
+static void write_block( int blocknum, const char *data );
+
+static long now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+static int dirty_count() {
+	return __atomic_load_n(&ndirty, __ATOMIC_RELAXED);
+}
+
+static void mark_dirty(int cacheIndex) {
+	if (!cache[cacheIndex].dirty_bit) {
+		cache[cacheIndex].dirty_bit = 1;
+		int dirty = __atomic_add_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+		if (writeback_enabled) {
+			cache[cacheIndex].dirty_since = now_ms();
+			if (dirty > dirty_background) {
+				pthread_cond_signal(&flusher_wake);
+			}
+		}
+	}
+}
+
+static void mark_clean(int cacheIndex) {
+	if (cache[cacheIndex].dirty_bit) {
+		cache[cacheIndex].dirty_bit = 0;
+		__atomic_sub_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*Makes a writer wait while the dirty entries are at the hard limit, unless the flusher cannot make progress.
+It is called before the writer locks any shard.*/
+static void throttle_writer() {
+	if (!writeback_enabled || dirty_count() < dirty_limit || is_flusher) {
+		return;
+	}
+	COUNT(throttled_writes, 1);
+	pthread_mutex_lock(&writeback_lock);
+	do {
+		pthread_cond_signal(&flusher_wake);
+		pthread_cond_wait(&writeback_done, &writeback_lock);
+	} while (dirty_count() >= dirty_limit && writeback_progress > 0 && !flusher_stop);
+	pthread_mutex_unlock(&writeback_lock);
+}
+
+/*Body of the flusher thread. Each round first lets writeback_hook write back the dirty data of the upper layers,
+then copies up to WRITEBACK_BATCH dirty entries (all of them while there are more than dirty_background,
+only the expired ones otherwise), marks them clean and pins them while their copies are written without holding any lock.*/
+static void* flusher_main(void* arg) {
+	size_t mapped;
+	char* batch = (char*)alloc_arena(WRITEBACK_BATCH * DISK_BLOCK_SIZE, 0, &mapped);
+	int entries[WRITEBACK_BATCH];
+	int blocknums[WRITEBACK_BATCH];
+
+	is_flusher = 1;
+	pthread_mutex_lock(&writeback_lock);
+	while (!flusher_stop) {
+		pthread_mutex_unlock(&writeback_lock);
+		pthread_mutex_lock(&writeback_hook_lock);
+		if (writeback_hook != NULL) {
+			writeback_hook(dirty_expire_ms, dirty_background);
+		}
+		pthread_mutex_unlock(&writeback_hook_lock);
+		pthread_mutex_lock(&writeback_round_lock);
+		long now = now_ms();
+		int over = dirty_count() > dirty_background;
+		int n = 0;
+		int scanned = 0;
+		while (scanned < cache_nblocks && n < WRITEBACK_BATCH && dirty_count() > 0) {
+			// the entries of a shard are consecutive, so the scan locks one shard at a time
+			int shardId = cache[writeback_cursor].shard;
+			pthread_mutex_lock(&shards[shardId].lock);
+			do {
+				int i = writeback_cursor;
+				writeback_cursor = (writeback_cursor + 1) % cache_nblocks;
+				scanned++;
+				if (!cache[i].dirty_bit || cache[i].refcount > 0) {
+					continue;
+				}
+				if (!over && now - cache[i].dirty_since < dirty_expire_ms) {
+					continue;
+				}
+				memcpy(batch + (size_t)n * DISK_BLOCK_SIZE, cache[i].datab->data, DISK_BLOCK_SIZE);
+				mark_clean(i);
+				cache[i].refcount++;	// so it is not evicted and read back before the copy is written
+				__atomic_add_fetch(&writeback_inflight, 1, __ATOMIC_RELAXED);
+				entries[n] = i;
+				blocknums[n] = cache[i].disk_block_number;
+				n++;
+			} while (scanned < cache_nblocks && n < WRITEBACK_BATCH && cache[writeback_cursor].shard == shardId);
+			pthread_mutex_unlock(&shards[shardId].lock);
+		}
+
+		if (n == 0) {
+			pthread_mutex_unlock(&writeback_round_lock);
+		}
+		pthread_mutex_lock(&writeback_lock);
+		writeback_progress = n;
+		if (n == 0) {
+			pthread_cond_broadcast(&writeback_done);
+			if (flusher_stop) {
+				break;
+			}
+			struct timespec until;
+			long wait_ms = dirty_expire_ms / 2 > 10 ? dirty_expire_ms / 2 : 10;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += wait_ms / 1000;
+			until.tv_nsec += (wait_ms % 1000) * 1000000;
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&flusher_wake, &writeback_lock, &until);
+			continue;
+		}
+		pthread_mutex_unlock(&writeback_lock);
+
+		// the copies are written in block order, adjacent blocks with a single write
+		int order[WRITEBACK_BATCH];
+		char* buffers[WRITEBACK_BATCH];
+		for (int k = 0; k < n; k++) {
+			order[k] = k;
+		}
+		sort_blocks = blocknums;
+		qsort(order, n, sizeof(int), compare_blocks);
+		int ops = 0;
+		for (int k = 0, run; k < n; k += run) {
+			for (run = 0; k + run < n && blocknums[order[k + run]] == blocknums[order[k]] + run; run++) {
+				buffers[run] = batch + (size_t)order[k + run] * DISK_BLOCK_SIZE;
+			}
+			int result = transfer_run(blocknums[order[k]], run, buffers, 1);
+			if (result < 0) {
+				printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+				abort();
+			}
+			map_mark_dirty(blocknums[order[k]], run);
+			ops += result;
+		}
+		COUNT(writes, n);
+		COUNT(write_ops, ops);
+		count_flush(n);
+
+		// unpinned before the round ends, so that disk_discard, which waits for it, can drop the entries
+		for (int k = 0; k < n; k++) {
+			struct cache_shard* shard = &shards[cache[entries[k]].shard];
+			pthread_mutex_lock(&shard->lock);
+			cache[entries[k]].refcount--;
+			pthread_mutex_unlock(&shard->lock);
+		}
+		__atomic_sub_fetch(&writeback_inflight, n, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&writeback_round_lock);
+		pthread_mutex_lock(&writeback_lock);
+		pthread_cond_broadcast(&writeback_done);
+	}
+	pthread_mutex_unlock(&writeback_lock);
+	free(batch);
+	return NULL;
+}
+
+/*Writes data from the cache at cacheIndex in the given buffer.*/
+void writeFromCacheToBuffer(int cacheIndex, char* buffer) {
+	memcpy(buffer, cache[cacheIndex].datab->data, DISK_BLOCK_SIZE);
+}
+
+/*Writes data from the given buffer in the cache at cacheIndex.*/
+void writeFromBufferToCache(int cacheIndex, const char* buffer) {
+	memcpy(cache[cacheIndex].datab->data, buffer, DISK_BLOCK_SIZE);
+	mark_dirty(cacheIndex);
+}
+
+/*Sets a new entry in cache at cacheIndex (of shard) for the block at blocknum in disk.*/
+void setNewCacheEntry(struct cache_shard* shard, int cacheIndex, int blocknum) {
+	mark_clean(cacheIndex);
+	cache[cacheIndex].disk_block_number = blocknum;
+	index_insert(shard, cacheIndex);
+}
+int entry_selection(struct cache_shard* shard);
+static int select_entry(struct cache_shard* shard, int clean_only);
+
+/*Flushes the contents of a cache block at cacheIndex into disk*/
+void disk_flush_block(int cacheIndex) {
+	write_block(cache[cacheIndex].disk_block_number, cache[cacheIndex].datab->data);
+	mark_clean(cacheIndex);
+}
+
+/*Sets a new entry in the (locked) shard for the block at blocknum in disk.
+Returns the cacheIndex in which the new entry was stored, or -1 if every entry of the shard is pinned.*/
+int setNewEntryForBlock(struct cache_shard* shard, int blocknum) {
+	int cacheIndex = entry_selection(shard);
+	if (cacheIndex == -1) {
+		return -1;
+	}
+	setNewCacheEntry(shard, cacheIndex, blocknum);
+	policy->insert(shard, cacheIndex);
+	return cacheIndex;
+}
+
+/*Transfers a block between the image and data with pread/pwrite, retrying short transfers.
+In direct I/O mode unaligned buffers go through an aligned bounce buffer.
+Returns the number of pread/pwrite calls it took if success; -1 otherwise.*/
+static int transfer_block( int blocknum, char *data, int write ) {
+    char bounce[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+    char *buf = data;
+    if ( direct_io && ((unsigned long)data % DISK_BLOCK_SIZE) != 0 ) {
+        buf = bounce;
+        if ( write )
+            memcpy( buf, data, DISK_BLOCK_SIZE );
+    }
+    off_t position = (off_t)blocknum * DISK_BLOCK_SIZE;
+    size_t done = 0;
+    int ops = 0;
+    while ( done < DISK_BLOCK_SIZE ) {
+        ssize_t result = write ? pwrite( diskfd, buf + done, DISK_BLOCK_SIZE - done, position + done )
+                               : pread( diskfd, buf + done, DISK_BLOCK_SIZE - done, position + done );
+        ops++;
+        if ( result < 0 && errno == EINTR )
+            continue;
+        if ( result <= 0 )
+            return -1;
+        done += result;
+    }
+    if ( buf != data && !write )
+        memcpy( data, buf, DISK_BLOCK_SIZE );
+    return ops;
+}
+
+/*Records that count blocks starting at blocknum were written through the mapping, for map_sync.*/
+static void map_mark_dirty( int blocknum, int count ) {
+    if ( backend != DISK_BACKEND_MMAP )
+        return;
+    pthread_mutex_lock( &map_lock );
+    memset( map_dirty + blocknum, 1, count );
+    if ( blocknum < map_dirty_first )
+        map_dirty_first = blocknum;
+    if ( blocknum + count - 1 > map_dirty_last )
+        map_dirty_last = blocknum + count - 1;
+    pthread_mutex_unlock( &map_lock );
+}
+
+/*Transfers count consecutive blocks, starting at blocknum, between the image and buffers[0..count-1].
+On the pread backend each group of up to IOV_MAX blocks is a single preadv/pwritev.
+Returns the number of I/O operations it took if success: the system calls, retries included, or 1 for
+the copy of the mmap backend and for the null backend; -1 otherwise.*/
+static int transfer_run( int blocknum, int count, char *const *buffers, int write ) {
+    if ( backend == DISK_BACKEND_NULL ) {
+        for ( int i = 0; i < count && !write; i++ )
+            memset( buffers[i], 0, DISK_BLOCK_SIZE );
+        return 1;
+    }
+    if ( backend == DISK_BACKEND_MMAP ) {
+        for ( int i = 0; i < count; i++ ) {
+            char *block = disk_map + (size_t)(blocknum + i) * DISK_BLOCK_SIZE;
+            if ( write )
+                memcpy( block, buffers[i], DISK_BLOCK_SIZE );
+            else
+                memcpy( buffers[i], block, DISK_BLOCK_SIZE );
+        }
+        return 1;
+    }
+    if ( count == 1 )
+        return transfer_block( blocknum, buffers[0], write );
+    if ( direct_io ) {
+        for ( int i = 0; i < count; i++ ) {
+            if ( ((unsigned long)buffers[i] % DISK_BLOCK_SIZE) != 0 ) {
+                // unaligned buffers are bounced one block at a time
+                int ops = 0;
+                for ( int j = 0; j < count; j++ ) {
+                    int result = transfer_block( blocknum + j, buffers[j], write );
+                    if ( result < 0 )
+                        return -1;
+                    ops += result;
+                }
+                return ops;
+            }
+        }
+    }
+
+    struct iovec iov[IOV_MAX];
+    int done = 0, ops = 0;
+    while ( done < count ) {
+        int n = count - done < IOV_MAX ? count - done : IOV_MAX;
+        for ( int i = 0; i < n; i++ ) {
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = DISK_BLOCK_SIZE;
+        }
+        off_t position = (off_t)(blocknum + done) * DISK_BLOCK_SIZE;
+        struct iovec *next = iov;
+        int left = n;
+        while ( left > 0 ) {
+            ssize_t result = write ? pwritev( diskfd, next, left, position )
+                                   : preadv( diskfd, next, left, position );
+            ops++;
+            if ( result < 0 && errno == EINTR )
+                continue;
+            if ( result <= 0 )
+                return -1;
+            position += result;
+            // skips the buffers that were completely transferred
+            while ( left > 0 && (size_t)result >= next->iov_len ) {
+                result -= next->iov_len;
+                next++;
+                left--;
+            }
+            if ( left > 0 ) {
+                next->iov_base = (char *)next->iov_base + result;
+                next->iov_len -= result;
+            }
+        }
+        done += n;
+    }
+    return ops;
+}
+
+/*Reads a block from the image, bypassing the cache.*/
+static void read_block( int blocknum, char *data ) {
+    sanity_check( blocknum, data );
+
+    int ops = transfer_run( blocknum, 1, &data, 0 );
+    if ( ops >= 0 ) {
+        COUNT( reads, 1 );
+        COUNT( read_ops, ops );
+    } else {
+        printf( "ERROR: couldn't access simulated disk: %s\n",
+                strerror( errno ) );
+        abort();
+    }
+}
+
+/*Writes a block to the image, bypassing the cache.*/
+static void write_block( int blocknum, const char *data ) {
+#ifdef DEBUG
+    printf( "Writing block %d\n", blocknum );
+#endif
+    sanity_check( blocknum, data );
+
+    int ops = transfer_run( blocknum, 1, (char *const *)&data, 1 );
+    if ( ops >= 0 ) {
+        map_mark_dirty( blocknum, 1 );
+        COUNT( writes, 1 );
+        COUNT( write_ops, ops );
+    } else {
+        printf( "ERROR: couldn't access simulated disk: %s\n",
+                strerror( errno ) );
+        abort();
+    }
+}
+
+void disk_read( int blocknum, char *data ) {
+    read_block( blocknum, data );
+}
+
+void disk_write( int blocknum, const char *data ) {
+    write_block( blocknum, data );
+}
+
+/*Transfers count blocks starting at blocknum between the image and data, bypassing the cache,
+with one I/O per RANGE_CHUNK blocks.*/
+static void transfer_uncached( int blocknum, int count, char *data, int write ) {
+    char *buffers[RANGE_CHUNK];
+    for ( int done = 0; done < count; done += RANGE_CHUNK ) {
+        int n = count - done < RANGE_CHUNK ? count - done : RANGE_CHUNK;
+        sanity_check( blocknum + done, data );
+        sanity_check( blocknum + done + n - 1, data );
+        for ( int i = 0; i < n; i++ )
+            buffers[i] = data + (size_t)(done + i) * DISK_BLOCK_SIZE;
+        int ops = transfer_run( blocknum + done, n, buffers, write );
+        if ( ops < 0 ) {
+            printf( "ERROR: couldn't access simulated disk: %s\n",
+                    strerror( errno ) );
+            abort();
+        }
+        if ( write ) {
+            map_mark_dirty( blocknum + done, n );
+            COUNT( writes, n );
+            COUNT( write_ops, ops );
+        } else {
+            COUNT( reads, n );
+            COUNT( read_ops, ops );
+        }
+    }
+}
+
+void disk_read_blocks( int blocknum, int count, char *data ) {
+    transfer_uncached( blocknum, count, data, 0 );
+}
+
+void disk_write_blocks( int blocknum, int count, const char *data ) {
+    transfer_uncached( blocknum, count, (char *)data, 1 );
+}
+
+// allocates a cache_entry of the (locked) shard where to place the new block
+int entry_selection(struct cache_shard* shard)
+{
+	return select_entry(shard, 0);
+}
+
+/*Same as entry_selection; with clean_only it fails (returns -1) instead of evicting a dirty block.*/
+static int select_entry(struct cache_shard* shard, int clean_only)
+{
+	if (shard->nfree_entries > 0) {
+		return shard->free_entries[--shard->nfree_entries];
+	}
+	// the policy prefers clean victims; a dirty one has to be written back first
+	int entry_num = policy->victim(shard, clean_only);
+	if (entry_num == NO_ENTRY) {
+		return -1;
+	}
+	if (cache[entry_num].readahead) {
+		// prefetched for nothing: the stream's window shrinks
+		COUNT(ra_wasted, 1);
+		pthread_mutex_lock(&ra_lock);
+		struct ra_stream* stream = &ra_streams[cache[entry_num].ra_stream];
+		stream->window = stream->window / 2 > RA_MIN_WINDOW ? stream->window / 2 : RA_MIN_WINDOW;
+		pthread_mutex_unlock(&ra_lock);
+		cache[entry_num].readahead = 0;
+	}
+	if (cache[entry_num].dirty_bit == 1) {
+		COUNT(evictions_dirty, 1);
+		disk_flush_block(entry_num);
+	} else {
+		COUNT(evictions_clean, 1);
+	}
+	index_remove(shard, entry_num);
+	cache[entry_num].disk_block_number = FREE_BLOCK;
+	return entry_num;
+}
+
+/*Accounts for a hit on the cache entry at cacheIndex of the (locked) shard.*/
+static void cache_hit(struct cache_shard* shard, int cacheIndex) {
+	COUNT(hits, 1);
+	policy->access(shard, cacheIndex);
+	if (cache[cacheIndex].readahead) {
+		COUNT(ra_hits, 1);
+		pthread_mutex_lock(&ra_lock);
+		ra_streams[cache[cacheIndex].ra_stream].hits++;
+		pthread_mutex_unlock(&ra_lock);
+		cache[cacheIndex].readahead = 0;
+	}
+}
+
+/*Prefetches up to count blocks starting at first for the stream, into clean cache entries.
+Blocks already cached are skipped; the others are read with one I/O per run of adjacent blocks.
+Returns the first block that was not prefetched.*/
+static int prefetch(int streamId, int first, int count) {
+	char* buffers[RANGE_CHUNK];
+	int blocknum = first;
+	int end = first + count < nblocks ? first + count : nblocks;
+	if (blocknum >= end) {
+		return blocknum;
+	}
+	shard_set locked = shards_of_range(first, end - first);
+	lock_shards(locked);
+	while (blocknum < end) {
+		if (search_cache(shard_for_block(blocknum), blocknum) != -1) {
+			blocknum++;
+			continue;
+		}
+		int run = 0;
+		while (blocknum + run < end && run < RANGE_CHUNK && search_cache(shard_for_block(blocknum + run), blocknum + run) == -1) {
+			struct cache_shard* shard = shard_for_block(blocknum + run);
+			int cacheIndex = select_entry(shard, 1);
+			if (cacheIndex == -1) {
+				break;	// only dirty or pinned entries left
+			}
+			setNewCacheEntry(shard, cacheIndex, blocknum + run);
+			policy->insert(shard, cacheIndex);
+			cache[cacheIndex].readahead = 1;
+			cache[cacheIndex].ra_stream = streamId;
+			buffers[run++] = cache[cacheIndex].datab->data;
+		}
+		if (run > 0) {
+			int ops = transfer_run(blocknum, run, buffers, 0);
+			if (ops < 0) {
+				printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+				abort();
+			}
+			COUNT(reads, run);
+			COUNT(read_ops, ops);
+			COUNT(ra_blocks, run);
+		}
+		blocknum += run;
+		if (blocknum < end && search_cache(shard_for_block(blocknum), blocknum) == -1) {
+			break;
+		}
+	}
+	unlock_shards(locked);
+	return blocknum;
+}
+
+/*Tells readahead that count blocks starting at blocknum were read. No shard may be locked.*/
+static void readahead_access(int blocknum, int count) {
+	if (ra_max_window == 0) {
+		return;
+	}
+	int end = blocknum + count;
+	int streamId = 0;
+	pthread_mutex_lock(&ra_lock);
+	for (int i = 0; i < RA_STREAMS; i++) {
+		if (ra_streams[i].next_block == blocknum) {
+			streamId = i;
+			break;
+		}
+		if (ra_streams[i].last_use < ra_streams[streamId].last_use) {
+			streamId = i;
+		}
+	}
+	struct ra_stream* stream = &ra_streams[streamId];
+	stream->last_use = ++ra_clock;
+	if (stream->next_block != blocknum) {
+		// not a continuation: a new stream starts, which is only prefetched for if it goes on
+		stream->next_block = end;
+		stream->ra_end = end;
+		stream->window = RA_MIN_WINDOW;
+		stream->hits = 0;
+		pthread_mutex_unlock(&ra_lock);
+		return;
+	}
+	stream->next_block = end;
+	if (stream->ra_end < end) {
+		stream->ra_end = end;
+	}
+	if (stream->ra_end - end <= stream->window / 2 && stream->ra_end < nblocks) {
+		if (stream->hits >= stream->window / 2) {
+			stream->window = 2 * stream->window < ra_max_window ? 2 * stream->window : ra_max_window;
+		}
+		stream->hits = 0;
+		// the prefetch runs without ra_lock; meanwhile the window counts as prefetched,
+		// so the other readers of the stream do not prefetch it too
+		int first = stream->ra_end;
+		int window = stream->window;
+		stream->ra_end = first + window;
+		pthread_mutex_unlock(&ra_lock);
+		int prefetched = prefetch(streamId, first, window);
+		pthread_mutex_lock(&ra_lock);
+		if (stream->ra_end == first + window) {
+			stream->ra_end = prefetched;
+		}
+	}
+	pthread_mutex_unlock(&ra_lock);
+}
+
+// Cache aware read
+void disk_read_data( int blocknum, char *data ) {
+ 	sanity_check( blocknum, data );
+	int cacheIndex;
+#ifdef DEBUG
+    printf( "disk_read_data for block %d \n", blocknum );
+#endif
+	if (cache_nblocks == 0) {
+		TRACE(blocknum, 1, DISK_TRACE_READ, 0);
+		read_block(blocknum, data);
+		return;
+	}
+
+	struct cache_shard* shard = shard_for_block(blocknum);
+	pthread_mutex_lock(&shard->lock);
+	cacheIndex = search_cache(shard, blocknum);
+	TRACE(blocknum, 1, DISK_TRACE_READ, cacheIndex != -1);
+	if (cacheIndex == -1) {
+		COUNT(misses, 1);
+		cacheIndex = setNewEntryForBlock(shard, blocknum);
+		if (cacheIndex == -1) {
+			read_block(blocknum, data);	// every entry is pinned
+			pthread_mutex_unlock(&shard->lock);
+			return;
+		}
+		read_block(blocknum, cache[cacheIndex].datab->data);
+	} else {
+		cache_hit(shard, cacheIndex);
+	}
+	writeFromCacheToBuffer(cacheIndex, data);
+	pthread_mutex_unlock(&shard->lock);
+	readahead_access(blocknum, 1);
+}
+
+// Cache aware write
+void disk_write_data(int blocknum, const char* data) {
+	sanity_check( blocknum, data );
+
+#ifdef DEBUG
+	printf( "disk_write_data for block %d \n", blocknum );
+#endif
+	if (cache_nblocks == 0) {
+		TRACE(blocknum, 1, DISK_TRACE_WRITE, 0);
+		write_block(blocknum, data);
+		return;
+	}
+	throttle_writer();
+	struct cache_shard* shard = shard_for_block(blocknum);
+	pthread_mutex_lock(&shard->lock);
+	int cacheIndex = search_cache(shard, blocknum);
+	TRACE(blocknum, 1, DISK_TRACE_WRITE, cacheIndex != -1);
+	if (cacheIndex == -1) {
+		COUNT(misses, 1);
+		cacheIndex = setNewEntryForBlock(shard, blocknum);
+		if (cacheIndex == -1) {
+			write_block(blocknum, data);	// every entry is pinned
+			pthread_mutex_unlock(&shard->lock);
+			return;
+		}
+	} else {
+		cache_hit(shard, cacheIndex);
+	}
+	writeFromBufferToCache(cacheIndex, data);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*Reads blocknums[0..count-1] into buffers[0..count-1]; the shards of the blocks must be locked.
+Cache hits are copied from the cache; the misses on adjacent blocks are read with a single transfer
+and then placed in the cache.*/
+static void read_vector(const int* blocknums, int count, char* const* buffers) {
+	int i = 0;
+	while (i < count) {
+		sanity_check(blocknums[i], buffers[i]);
+		int cacheIndex = cache_nblocks > 0 ? search_cache(shard_for_block(blocknums[i]), blocknums[i]) : -1;
+		if (cacheIndex != -1) {
+			TRACE(blocknums[i], 1, DISK_TRACE_READ, 1);
+			cache_hit(shard_for_block(blocknums[i]), cacheIndex);
+			writeFromCacheToBuffer(cacheIndex, buffers[i]);
+			i++;
+			continue;
+		}
+		int run = 1;
+		while (i + run < count && blocknums[i + run] == blocknums[i] + run
+			&& (cache_nblocks == 0 || search_cache(shard_for_block(blocknums[i + run]), blocknums[i + run]) == -1)) {
+			sanity_check(blocknums[i + run], buffers[i + run]);
+			run++;
+		}
+		TRACE(blocknums[i], run, DISK_TRACE_READ, 0);
+		int ops = transfer_run(blocknums[i], run, buffers + i, 0);
+		if (ops < 0) {
+			printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+			abort();
+		}
+		COUNT(reads, run);
+		COUNT(read_ops, ops);
+		for (int j = i; j < i + run && cache_nblocks > 0; j++) {
+			COUNT(misses, 1);
+			cacheIndex = setNewEntryForBlock(shard_for_block(blocknums[j]), blocknums[j]);
+			if (cacheIndex != -1) {
+				memcpy(cache[cacheIndex].datab->data, buffers[j], DISK_BLOCK_SIZE);
+			}
+		}
+		i += run;
+	}
+}
+
+/*Writes buffers[0..count-1] to blocknums[0..count-1]; the shards of the blocks must be locked.
+Cache hits are written in the cache; the misses on adjacent blocks are written to disk with a single transfer,
+without going through the cache.*/
+static void write_vector(const int* blocknums, int count, char* const* buffers) {
+	int i = 0;
+	while (i < count) {
+		sanity_check(blocknums[i], buffers[i]);
+		int cacheIndex = cache_nblocks > 0 ? search_cache(shard_for_block(blocknums[i]), blocknums[i]) : -1;
+		if (cacheIndex != -1) {
+			TRACE(blocknums[i], 1, DISK_TRACE_WRITE, 1);
+			cache_hit(shard_for_block(blocknums[i]), cacheIndex);
+			writeFromBufferToCache(cacheIndex, buffers[i]);
+			i++;
+			continue;
+		}
+		int run = 1;
+		while (i + run < count && blocknums[i + run] == blocknums[i] + run
+			&& (cache_nblocks == 0 || search_cache(shard_for_block(blocknums[i + run]), blocknums[i + run]) == -1)) {
+			sanity_check(blocknums[i + run], buffers[i + run]);
+			run++;
+		}
+		TRACE(blocknums[i], run, DISK_TRACE_WRITE, 0);
+		int ops = transfer_run(blocknums[i], run, buffers + i, 1);
+		if (ops < 0) {
+			printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+			abort();
+		}
+		map_mark_dirty(blocknums[i], run);
+		COUNT(writes, run);
+		COUNT(write_ops, ops);
+		if (cache_nblocks > 0) {
+			COUNT(misses, run);
+		}
+		i += run;
+	}
+}
+
+/*Block handed out by disk_get_block when it cannot be pinned in the cache
+(the cache is disabled or all the entries of its shard are pinned); disk_put_block writes it back and frees it.*/
+struct uncached_block {
+	int blocknum;
+	char* data;	// aligned DISK_BLOCK_SIZE buffer
+};
+
+static struct uncached_block* uncached_blocks;	// the blocks handed out and not yet released
+static int nuncached_blocks = 0;
+static int max_uncached_blocks = 0;
+static pthread_mutex_t uncached_lock = PTHREAD_MUTEX_INITIALIZER;	// protects uncached_blocks
+
+/*Returns the cache entry whose data is block, or -1 if block is not in the cache arena.*/
+static int entry_for_data(const char* block) {
+	if (cache_nblocks == 0 || block < cache_data[0].data || block >= cache_data[cache_nblocks].data) {
+		return -1;
+	}
+	return (block - cache_data[0].data) / sizeof(cache_memory);
+}
+
+static char* get_uncached_block(int blocknum, int mode) {
+	size_t mapped;
+	char* data = (char*)alloc_arena(DISK_BLOCK_SIZE, 0, &mapped);
+	if (mode == DISK_GET_READ) {
+		read_block(blocknum, data);
+	}
+	pthread_mutex_lock(&uncached_lock);
+	if (nuncached_blocks == max_uncached_blocks) {
+		max_uncached_blocks = max_uncached_blocks > 0 ? 2 * max_uncached_blocks : 4;
+		uncached_blocks = (struct uncached_block*)realloc(uncached_blocks, max_uncached_blocks * sizeof(struct uncached_block));
+	}
+	struct uncached_block* ublock = &uncached_blocks[nuncached_blocks++];
+	ublock->blocknum = blocknum;
+	ublock->data = data;
+	pthread_mutex_unlock(&uncached_lock);
+	return data;
+}
+
+static void put_uncached_block(char* block, int dirty) {
+	pthread_mutex_lock(&uncached_lock);
+	for (int i = 0; i < nuncached_blocks; i++) {
+		if (uncached_blocks[i].data == block) {
+			int blocknum = uncached_blocks[i].blocknum;
+			uncached_blocks[i] = uncached_blocks[--nuncached_blocks];
+			pthread_mutex_unlock(&uncached_lock);
+			if (dirty) {
+				write_block(blocknum, block);
+			}
+			free(block);
+			return;
+		}
+	}
+	printf("ERROR: disk_put_block of a block that is not in use!\n");
+	abort();
+}
+
+char* disk_get_block(int blocknum, int mode) {
+	sanity_check(blocknum, "");
+	if (cache_nblocks == 0) {
+		TRACE(blocknum, 1, mode == DISK_GET_WRITE ? DISK_TRACE_WRITE : DISK_TRACE_READ, 0);
+		return get_uncached_block(blocknum, mode);
+	}
+	if (mode == DISK_GET_WRITE) {
+		throttle_writer();
+	}
+	struct cache_shard* shard = shard_for_block(blocknum);
+	pthread_mutex_lock(&shard->lock);
+	int cacheIndex = search_cache(shard, blocknum);
+	TRACE(blocknum, 1, mode == DISK_GET_WRITE ? DISK_TRACE_WRITE : DISK_TRACE_READ, cacheIndex != -1);
+	if (cacheIndex == -1) {
+		COUNT(misses, 1);
+		cacheIndex = setNewEntryForBlock(shard, blocknum);
+		if (cacheIndex == -1) {
+			pthread_mutex_unlock(&shard->lock);
+			return get_uncached_block(blocknum, mode);
+		}
+		if (mode == DISK_GET_READ) {
+			read_block(blocknum, cache[cacheIndex].datab->data);
+		}
+	} else {
+		cache_hit(shard, cacheIndex);
+	}
+	cache[cacheIndex].refcount++;
+	pthread_mutex_unlock(&shard->lock);
+	if (mode == DISK_GET_READ) {
+		readahead_access(blocknum, 1);
+	}
+	return cache[cacheIndex].datab->data;
+}
+
+void disk_put_block(char* block, int dirty) {
+	int cacheIndex = entry_for_data(block);
+	if (cacheIndex == -1) {
+		put_uncached_block(block, dirty);
+		return;
+	}
+	struct cache_shard* shard = &shards[cache[cacheIndex].shard];
+	pthread_mutex_lock(&shard->lock);
+	if (cache[cacheIndex].refcount <= 0) {
+		printf("ERROR: disk_put_block of a block that is not pinned!\n");
+		abort();
+	}
+	cache[cacheIndex].refcount--;
+	if (dirty) {
+		mark_dirty(cacheIndex);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void disk_read_range(int blocknum, int count, char* data) {
+	int blocknums[RANGE_CHUNK];
+	char* buffers[RANGE_CHUNK];
+	for (int done = 0; done < count; done += RANGE_CHUNK) {
+		int n = count - done < RANGE_CHUNK ? count - done : RANGE_CHUNK;
+		for (int i = 0; i < n; i++) {
+			blocknums[i] = blocknum + done + i;
+			buffers[i] = data + (size_t)(done + i) * DISK_BLOCK_SIZE;
+		}
+		shard_set locked = shards_of_range(blocknum + done, n);
+		lock_shards(locked);
+		read_vector(blocknums, n, buffers);
+		unlock_shards(locked);
+	}
+	if (cache_nblocks > 0) {
+		readahead_access(blocknum, count);
+	}
+}
+
+void disk_write_range(int blocknum, int count, const char* data) {
+	int blocknums[RANGE_CHUNK];
+	char* buffers[RANGE_CHUNK];
+	if (cache_nblocks > 0) {
+		throttle_writer();
+	}
+	for (int done = 0; done < count; done += RANGE_CHUNK) {
+		int n = count - done < RANGE_CHUNK ? count - done : RANGE_CHUNK;
+		for (int i = 0; i < n; i++) {
+			blocknums[i] = blocknum + done + i;
+			buffers[i] = (char*)data + (size_t)(done + i) * DISK_BLOCK_SIZE;
+		}
+		shard_set locked = shards_of_range(blocknum + done, n);
+		lock_shards(locked);
+		write_vector(blocknums, n, buffers);
+		unlock_shards(locked);
+	}
+}
+
+void disk_readv(const int* blocknums, int count, char* const* buffers) {
+	shard_set locked = shards_of_blocks(blocknums, count);
+	lock_shards(locked);
+	read_vector(blocknums, count, buffers);
+	unlock_shards(locked);
+	for (int i = 0, run; i < count && cache_nblocks > 0; i += run) {
+		for (run = 1; i + run < count && blocknums[i + run] == blocknums[i] + run; run++);
+		readahead_access(blocknums[i], run);
+	}
+}
+
+void disk_writev(const int* blocknums, int count, char* const* buffers) {
+	if (cache_nblocks > 0) {
+		throttle_writer();
+	}
+	shard_set locked = shards_of_blocks(blocknums, count);
+	lock_shards(locked);
+	write_vector(blocknums, count, buffers);
+	unlock_shards(locked);
+}
+
+/*Drops the block at cacheIndex of the (locked) shard from the cache without writing it back.
+A pinned entry cannot be freed, so it is only marked clean.*/
+static void drop_entry(struct cache_shard* shard, int cacheIndex) {
+	mark_clean(cacheIndex);
+	if (cache[cacheIndex].refcount > 0) {
+		return;
+	}
+	index_remove(shard, cacheIndex);
+	policy->remove(shard, cacheIndex);
+	cache[cacheIndex].readahead = 0;
+	cache[cacheIndex].disk_block_number = FREE_BLOCK;
+	shard->free_entries[shard->nfree_entries++] = cacheIndex;
+}
+
+void disk_discard(int blocknum, int count) {
+	if (count <= 0) {
+		return;
+	}
+	sanity_check(blocknum, "");
+	sanity_check(blocknum + count - 1, "");
+	TRACE(blocknum, count, DISK_TRACE_DISCARD, 0);
+	if (cache_nblocks > 0) {
+		// the flusher must not be writing any of the blocks, nor keep them pinned
+		pthread_mutex_lock(&writeback_round_lock);
+		for (int done = 0; done < count; done += RANGE_CHUNK) {
+			int n = count - done < RANGE_CHUNK ? count - done : RANGE_CHUNK;
+			shard_set locked = shards_of_range(blocknum + done, n);
+			lock_shards(locked);
+			for (int b = blocknum + done; b < blocknum + done + n; b++) {
+				struct cache_shard* shard = shard_for_block(b);
+				int cacheIndex = search_cache(shard, b);
+				if (cacheIndex != -1) {
+					drop_entry(shard, cacheIndex);
+				}
+			}
+			unlock_shards(locked);
+		}
+		pthread_mutex_unlock(&writeback_round_lock);
+	}
+	if (backend == DISK_BACKEND_NULL) {
+		return;
+	}
+	// the image keeps its size, and the blocks read back as zeros
+	if (fallocate(diskfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t)blocknum * DISK_BLOCK_SIZE, (off_t)count * DISK_BLOCK_SIZE) < 0) {
+		char zeros[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+		memset(zeros, 0, DISK_BLOCK_SIZE);
+		for (int b = blocknum; b < blocknum + count; b++) {
+			write_block(b, zeros);
+		}
+	}
+}
+
+// Writes the cache's metadata
+void cache_debug() {
+	struct disk_stats total;
+	disk_counters_sum(&stats_counters, (long*)&total, 0);
+	lock_shards(all_shards());
+	int nfree = 0;
+	for (int s = 0; s < nshards; s++) {
+		nfree += shards[s].nfree_entries;
+	}
+	printf("Cache policy: %s, %d entries in %d shards (%d free, %d dirty)\n", policy->name, cache_nblocks, nshards, nfree, dirty_count());
+	if (writeback_enabled) {
+		printf("Writeback: background at %d dirty, limit %d, expire %ld ms, %d blocks in flight, %ld throttled writes\n",
+			dirty_background, dirty_limit, dirty_expire_ms, __atomic_load_n(&writeback_inflight, __ATOMIC_RELAXED), total.throttled_writes);
+	}
+	for (int s = 0; s < nshards; s++) {
+		printf("Shard %d: entries %d-%d, %d free\n", s, shards[s].first, shards[s].first + shards[s].nentries - 1, shards[s].nfree_entries);
+		policy->debug(&shards[s]);
+	}
+	printf("Readahead: max window %d, %ld blocks prefetched, %ld used, %ld wasted\n", ra_max_window, total.ra_blocks, total.ra_hits, total.ra_wasted);
+	for( int i = 0; i < cache_nblocks; i++ ) {
+    	// TODO
+		printf("Cache block: %d\n", i);
+		printf("	disk_block_number: %d\n", cache[i].disk_block_number);
+		printf("	dirty_bit: %d\n", cache[i].dirty_bit);
+		//printf("	datab: %d\n\n", &cache->datab);
+	}
+	unlock_shards(all_shards());
+}
+
+
+/* Asynchronous requests */
+
+static void read_request(struct disk_request* request) {
+	disk_read_range(request->blocknum, request->count, request->data);
+	request->result = 0;
+}
+
+static void write_request(struct disk_request* request) {
+	disk_write_range(request->blocknum, request->count, request->data);
+	request->result = 0;
+}
+
+/*Body of the worker threads: runs the submitted requests in order until disk_close,
+which lets them finish the queue first.*/
+static void* io_worker_main(void* arg) {
+	pthread_mutex_lock(&io_lock);
+	while (1) {
+		while (io_first == NULL && !io_stop) {
+			pthread_cond_wait(&io_submitted, &io_lock);
+		}
+		if (io_first == NULL) {
+			break;
+		}
+		struct disk_request* request = io_first;
+		io_first = request->next;
+		if (io_first == NULL) {
+			io_last = NULL;
+		}
+		pthread_mutex_unlock(&io_lock);
+
+		request->function(request);
+		if (request->callback != NULL) {
+			request->callback(request);
+			pthread_mutex_lock(&io_lock);
+			continue;
+		}
+		pthread_mutex_lock(&io_lock);
+		request->next = NULL;
+		if (done_last != NULL) {
+			done_last->next = request;
+		} else {
+			done_first = request;
+		}
+		done_last = request;
+		pthread_cond_broadcast(&io_completed);
+	}
+	pthread_mutex_unlock(&io_lock);
+	return NULL;
+}
+
+/*Queues request to run function, starting the worker threads if they are not running yet.*/
+static void submit_request(struct disk_request* request, void (*function)(struct disk_request*)) {
+	request->function = function;
+	request->next = NULL;
+	pthread_mutex_lock(&io_lock);
+	if (io_workers == NULL) {
+		io_stop = 0;
+		io_workers = (pthread_t*)malloc(sizeof(pthread_t) * io_threads);
+		for (int i = 0; i < io_threads; i++) {
+			if (pthread_create(&io_workers[i], NULL, io_worker_main, NULL) != 0) {
+				printf("ERROR: couldn't start the I/O threads: %s\n", strerror(errno));
+				abort();
+			}
+		}
+	}
+	if (request->callback == NULL) {
+		io_unreaped++;
+	}
+	if (io_last != NULL) {
+		io_last->next = request;
+	} else {
+		io_first = request;
+	}
+	io_last = request;
+	pthread_cond_signal(&io_submitted);
+	pthread_mutex_unlock(&io_lock);
+}
+
+void disk_submit_read(struct disk_request* request) {
+	submit_request(request, read_request);
+}
+
+void disk_submit_write(struct disk_request* request) {
+	submit_request(request, write_request);
+}
+
+void disk_submit_call(struct disk_request* request, void (*function)(struct disk_request* request)) {
+	submit_request(request, function);
+}
+
+struct disk_request* disk_reap(int wait) {
+	pthread_mutex_lock(&io_lock);
+	while (done_first == NULL && wait && io_unreaped > 0) {
+		pthread_cond_wait(&io_completed, &io_lock);
+	}
+	struct disk_request* request = done_first;
+	if (request != NULL) {
+		done_first = request->next;
+		if (done_first == NULL) {
+			done_last = NULL;
+		}
+		io_unreaped--;
+	}
+	pthread_mutex_unlock(&io_lock);
+	return request;
+}
+
+/*Stops the worker threads once they have carried out the submitted requests.*/
+static void stop_io_workers() {
+	pthread_mutex_lock(&io_lock);
+	if (io_workers == NULL) {
+		pthread_mutex_unlock(&io_lock);
+		return;
+	}
+	io_stop = 1;
+	pthread_cond_broadcast(&io_submitted);
+	pthread_mutex_unlock(&io_lock);
+	for (int i = 0; i < io_threads; i++) {
+		pthread_join(io_workers[i], NULL);
+	}
+	free(io_workers);
+	io_workers = NULL;
+}
+
+void disk_set_flush_hook( void (*hook)() ) {
+	flush_hook = hook;
+}
+
+void disk_set_writeback_hook( void (*hook)( long expire_ms, int background ) ) {
+	pthread_mutex_lock(&writeback_hook_lock);
+	writeback_hook = hook;
+	pthread_mutex_unlock(&writeback_hook_lock);
+}
+
+void disk_writeback_wake() {
+	if (writeback_enabled) {
+		pthread_cond_signal(&flusher_wake);
+	}
+}
+
+/*Writes back the pages of the mapping that hold dirty blocks, one msync per run of adjacent dirty blocks.*/
+static void map_sync() {
+	long pagesize = sysconf(_SC_PAGESIZE);
+	pthread_mutex_lock(&map_lock);
+	int blocknum = map_dirty_first;
+	while (blocknum <= map_dirty_last) {
+		if (!map_dirty[blocknum]) {
+			blocknum++;
+			continue;
+		}
+		int first = blocknum;
+		while (blocknum <= map_dirty_last && map_dirty[blocknum]) {
+			map_dirty[blocknum++] = 0;
+		}
+		size_t start = (size_t)first * DISK_BLOCK_SIZE;
+		size_t end = (size_t)blocknum * DISK_BLOCK_SIZE;
+		start -= start % pagesize;	// msync needs a page aligned address
+		if (msync(disk_map + start, end - start, MS_SYNC) < 0) {
+			perror("disk_flush msync");
+		}
+	}
+	map_dirty_first = nblocks;
+	map_dirty_last = -1;
+	pthread_mutex_unlock(&map_lock);
+}
+
+/*Writes all the dirty entries in increasing block order (elevator order),
+each run of adjacent blocks with a vectored write per IOV_MAX blocks. All the shards must be locked.*/
+static void flush_sorted() {
+	int ndirty = dirty_count();
+	if (ndirty == 0) {
+		return;
+	}
+	int* dirty = (int*)malloc(sizeof(int) * ndirty);
+	int* blocknums = (int*)malloc(sizeof(int) * ndirty);
+	char** buffers = (char**)malloc(sizeof(char*) * ndirty);
+	int* order = (int*)malloc(sizeof(int) * ndirty);
+	int n = 0;
+	for (int cacheIndex = 0; cacheIndex < cache_nblocks && n < ndirty; cacheIndex++) {
+		if (cache[cacheIndex].dirty_bit) {
+			dirty[n] = cacheIndex;
+			blocknums[n] = cache[cacheIndex].disk_block_number;
+			order[n] = n;
+			n++;
+		}
+	}
+	sort_blocks = blocknums;
+	qsort(order, n, sizeof(int), compare_blocks);
+	count_flush(n);
+	for (int k = 0, run; k < n; k += run) {
+		for (run = 0; k + run < n && blocknums[order[k + run]] == blocknums[order[k]] + run; run++) {
+			buffers[run] = cache[dirty[order[k + run]]].datab->data;
+		}
+		int ops = transfer_run(blocknums[order[k]], run, buffers, 1);
+		if (ops < 0) {
+			printf("ERROR: couldn't access simulated disk: %s\n", strerror(errno));
+			abort();
+		}
+		map_mark_dirty(blocknums[order[k]], run);
+		COUNT(writes, run);
+		COUNT(write_ops, ops);
+		for (int j = k; j < k + run; j++) {
+			mark_clean(dirty[order[j]]);
+		}
+	}
+	free(dirty);
+	free(blocknums);
+	free(buffers);
+	free(order);
+}
+
+// flushes the modified data blocks to disk
+void disk_sync() {
+	if (backend == DISK_BACKEND_MMAP) {
+		map_sync();
+	} else if (backend != DISK_BACKEND_NULL && fdatasync(diskfd) < 0) {
+		perror("disk_sync fdatasync");
+	}
+}
+
+/*Writes back the dirty blocks of the cache; with durable, also waits until they are on stable storage.*/
+static void flush_cache(int durable) {
+	// waits for the blocks being written by the flusher, which must reach the disk too
+	pthread_mutex_lock(&writeback_round_lock);
+	lock_shards(all_shards());
+	flush_sorted();
+	if (durable) {
+		disk_sync();
+	}
+	unlock_shards(all_shards());
+	pthread_mutex_unlock(&writeback_round_lock);
+}
+
+void disk_flush_cache() {
+	flush_cache(0);
+}
+
+void disk_flush() {
+	if (flush_hook != NULL) {
+		flush_hook();
+	}
+	flush_cache(backend == DISK_BACKEND_MMAP || flush_sync);
+}
+
+
+void disk_stats( struct disk_stats *stats ) {
+	disk_counters_sum(&stats_counters, (long*)stats, 1);
+}
+
+void disk_stats_reset( ) {
+	disk_counters_reset(&stats_counters);
+}
+
+void disk_close( ) {
+	if (diskfd >= 0)  {
+		stop_io_workers();
+		if (writeback_enabled) {
+			pthread_mutex_lock(&writeback_lock);
+			flusher_stop = 1;
+			pthread_cond_signal(&flusher_wake);
+			pthread_cond_broadcast(&writeback_done);
+			pthread_mutex_unlock(&writeback_lock);
+			pthread_join(flusher, NULL);
+			writeback_enabled = 0;
+		}
+		// flushes the cache and frees the allocated memory
+		disk_flush();
+		for (int s = 0; s < nshards; s++) {
+			policy->close(&shards[s]);
+			free(shards[s].index);
+			pthread_mutex_destroy(&shards[s].lock);
+		}
+		free(shards);
+		shards = NULL;
+		nshards = 0;
+		policy_free();
 		free(cache);
-		free(cache_data);
+		free_arena(cache_data, cache_data_mapped);
+		free(free_entries);
+		free(uncached_blocks);
+		uncached_blocks = NULL;
+		nuncached_blocks = max_uncached_blocks = 0;
+		if (trace_fd >= 0) {
+			trace_close();
+		}
 		// Writes statistics
-		printf( "%d disk block reads\n", nreads );
-  		printf( "%d disk block writes\n", nwrites );
-		printf( "%d cache hits, %d cache misses\n", cachehits, cachemisses),
+		struct disk_stats total;
+		disk_counters_sum(&stats_counters, (long*)&total, 0);
+		disk_counters_free(&stats_counters);
+		printf( "%ld disk block reads (%ld read operations)\n", total.reads, total.read_ops );
+  		printf( "%ld disk block writes (%ld write operations)\n", total.writes, total.write_ops );
+		printf( "%ld cache hits, %ld cache misses\n", total.hits, total.misses);
+		if ( total.ra_blocks > 0 )
+			printf( "%ld readahead blocks, %ld readahead hits, %ld readahead wasted\n", total.ra_blocks, total.ra_hits, total.ra_wasted );
 
-		fclose( diskfile );
-		diskfile = 0;
+		if ( backend == DISK_BACKEND_MMAP ) {
+			munmap( disk_map, (size_t)nblocks * DISK_BLOCK_SIZE );
+			disk_map = NULL;
+			free( map_dirty );
+			map_dirty = NULL;
+		}
+		close( diskfd );
+		diskfd = -1;
 
 	}
 
@@ -1,12 +1,65 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <pthread.h>
+
 #define DISK_BLOCK_SIZE 4096
 
+/*Cache replacement policies.*/
+#define CACHE_POLICY_RANDOM 0
+#define CACHE_POLICY_LRU    1
+#define CACHE_POLICY_CLOCK  2
+#define CACHE_POLICY_2Q     3
+
+/*Ways of accessing the disk image.*/
+#define DISK_BACKEND_PREAD 0	// pread/pwrite on the image file
+#define DISK_BACKEND_MMAP  1	// memcpy to/from a shared mapping of the whole image
+#define DISK_BACKEND_NULL  2	// no image: blocks read as zeros and writes are dropped, for simulations
+
+/*Access pattern hints for the mmap backend.*/
+#define DISK_ADVICE_NORMAL     0
+#define DISK_ADVICE_SEQUENTIAL 1
+#define DISK_ADVICE_RANDOM     2
+
+/*Options of the disk and of its cache, chosen at disk_init time.*/
+struct disk_config {
+	int cache_policy;	// one of CACHE_POLICY_*
+	int direct_io;	// 1 to open the image with O_DIRECT, bypassing the page cache
+	int huge_pages;	// 1 to back the cache with huge pages
+	int backend;	// one of DISK_BACKEND_*
+	int cache_blocks;	// number of cached blocks; 0 disables the cache, -1 uses 20% of the disk
+	int map_advice;	// one of DISK_ADVICE_*, for the mmap backend
+	int readahead;	// maximum sequential readahead window in blocks; 0 disables readahead
+	int writeback;	// 1 to clean dirty blocks with a background flusher thread
+	int dirty_background;	// % of the cache dirty at which the flusher starts cleaning
+	int dirty_limit;	// % of the cache dirty at which writers wait for the flusher
+	int dirty_expire;	// ms after which the flusher cleans a dirty block anyway
+	int flush_sync;	// 1 to end disk_flush with fdatasync, so the flushed blocks are durable
+	int cache_shards;	// number of independently locked parts of the cache; 0 chooses it from the cache size
+	int io_threads;	// worker threads that carry out the asynchronous requests
+	char trace_file[256];	// file to record the block accesses in (see struct disk_trace_record); empty for none
+};
+
+/*Fills config with the default options.*/
+void disk_config_default( struct disk_config *config );
+
+/*Sets one option given as "name=value":
+policy=random|lru|clock|2q, direct=0|1, hugepages=0|1, backend=pread|mmap|null,
+cache=<nblocks>, shards=<n>, advice=normal|sequential|random, readahead=<nblocks>,
+writeback=0|1, dirty_background=<percent>, dirty_limit=<percent>, dirty_expire=<ms>, fsync=0|1,
+io_threads=<n>, trace=<file>.
+Returns 0 if success; -1 if the option is unknown or the value is invalid.*/
+int  disk_config_set( struct disk_config *config, const char *option );
+
 /*This function must be invoked before calling other API functions.
-It is only possible to have one active disk at some point in time.*/
+It is only possible to have one active disk at some point in time.
+The other functions, except disk_close, may be called from several threads at the same time.*/
 int  disk_init( const char *filename, int nblocks );
 
+/*Same as disk_init, with the given options instead of the default ones.
+Fails if the cache policy or the mmap advice is not one of the defined ones.*/
+int  disk_init_config( const char *filename, int nblocks, const struct disk_config *config );
+
 /*Returns an integer with the total number of the blocks in the disk.*/
 int  disk_size();
 
@@ -19,12 +72,192 @@ void disk_read_data(int blocknum, char* data);
 /*Writes, in the block blocknum of the disk, a total of 4096 bytes starting at memory address data.*/
 void disk_write( int blocknum, const char *data );
 
+/*Transfer count consecutive blocks starting at blocknum, bypassing the cache like disk_read/disk_write,
+with as few I/Os as possible. For metadata that the upper layers keep in memory themselves.*/
+void disk_read_blocks( int blocknum, int count, char *data );
+void disk_write_blocks( int blocknum, int count, const char *data );
+
 /*Function that uses the cache whenever a data block has to be written on disk.*/
 void disk_write_data(int blocknum, const char* data);
 
-/*Function that flushes all the dirty data blocks in the cache onto disk*/
+/*Cache aware read of count consecutive blocks starting at blocknum into data (count * 4096 bytes).
+Cache hits are served from the cache and adjacent misses are read with a single I/O.*/
+void disk_read_range( int blocknum, int count, char *data );
+
+/*Cache aware write of count consecutive blocks starting at blocknum from data (count * 4096 bytes).
+Cached blocks are updated in the cache; adjacent uncached blocks are written to disk with a single I/O.*/
+void disk_write_range( int blocknum, int count, const char *data );
+
+/*Vectored versions of disk_read_range/disk_write_range: block blocknums[i] is transferred to/from buffers[i].
+Runs of adjacent block numbers are merged into single I/Os.*/
+void disk_readv( const int *blocknums, int count, char *const *buffers );
+void disk_writev( const int *blocknums, int count, char *const *buffers );
+
+/*Discards count blocks starting at blocknum, whose contents are no longer needed: they are dropped from
+the cache without being written back and the image releases their storage (fallocate PUNCH_HOLE),
+so they read back as zeros. The blocks must not be pinned with disk_get_block.*/
+void disk_discard( int blocknum, int count );
+
+/*Modes of disk_get_block.*/
+#define DISK_GET_READ  0	// the current contents of the block are needed
+#define DISK_GET_WRITE 1	// the whole block will be overwritten, so it is not read from disk
+
+/*Pins the block blocknum in the cache and returns a pointer to its 4096 bytes in the cache,
+so they can be read or modified in place. The block is not evicted until it is released with disk_put_block.
+A disk_flush from another thread may write the block while it is being modified;
+releasing it as dirty makes the next flush write the final contents.*/
+char *disk_get_block( int blocknum, int mode );
+
+/*Releases a block returned by disk_get_block; dirty is 1 if its contents were modified.*/
+void disk_put_block( char *block, int dirty );
+
+/*Asynchronous request. disk_submit_read/disk_submit_write queue it, and a pool of worker threads
+(started on the first submission) carries it out through the cache, like disk_read_range/disk_write_range.
+When it finishes, its callback is called in the worker thread; requests without a callback are put
+in a completion queue instead, from which disk_reap takes them.
+The request and its data must stay valid until it completes.*/
+struct disk_request {
+	int blocknum;	// first block
+	int count;	// number of consecutive blocks
+	char *data;	// count * 4096 bytes
+	int result;	// set when the request completes: 0 for the I/O requests, see disk_submit_call
+	void (*callback)( struct disk_request *request );	// NULL to use the completion queue
+	void *context;	// free for the submitter
+	// private
+	void (*function)( struct disk_request *request );
+	struct disk_request *next;
+};
+
+void disk_submit_read( struct disk_request *request );
+void disk_submit_write( struct disk_request *request );
+
+/*Queues a request that runs function(request) in a worker thread, which may set its result,
+and then completes like the I/O requests. For the layers above the disk.*/
+void disk_submit_call( struct disk_request *request, void (*function)( struct disk_request *request ) );
+
+/*Returns a completed request that had no callback. If there is none yet and wait is 1,
+waits for one, unless no such request is in flight. Returns NULL if there is none.*/
+struct disk_request *disk_reap( int wait );
+
+/*Function that flushes all the dirty data blocks in the cache onto disk.
+They are written in block order, adjacent blocks with a single I/O.*/
 void disk_flush();
 
+/*Writes the dirty blocks of the cache like disk_flush, without calling the flush hook or waiting for the disk.*/
+void disk_flush_cache();
+
+/*Waits until all the blocks written to the disk so far are on stable storage (fdatasync, or msync with backend=mmap).*/
+void disk_sync();
+
+/*Registers a function that disk_flush calls before flushing the cache,
+so that upper layers can write back the metadata they keep in memory.*/
+void disk_set_flush_hook( void (*hook)() );
+
+/*Registers a function that the background flusher (writeback=1) calls in each of its rounds, holding no lock,
+so that upper layers that keep dirty data outside the cache write it back on the same terms as the cache:
+the data dirty for longer than expire_ms, and all of it while there are more than background blocks.
+The function must not wait for locks that threads writing to the disk may hold. Setting it to NULL waits
+until a call in progress returns.*/
+void disk_set_writeback_hook( void (*hook)( long expire_ms, int background ) );
+
+/*Starts a round of the background flusher now, if there is one; for upper layers whose dirty data went over the limit.*/
+void disk_writeback_wake();
+
+/*Per-thread counters, for statistics that many threads update. Each thread gets a zeroed array of n longs
+of its own on its first count, on cache lines of its own, and only that thread writes it, with
+DISK_COUNTER_ADD; disk_counters_sum adds up the arrays of all the threads, while they keep counting.
+A set is declared with DISK_COUNTER_SET_INIT, and each thread keeps its array in a zeroed __thread
+disk_counter_slot of the set. disk_stats is counted this way, and upper layers may count theirs too.*/
+struct disk_counter_block;
+struct disk_counter_set {
+	int n;	// counters per thread
+	pthread_mutex_t lock;	// protects the fields below, which are private
+	struct disk_counter_block *all;	// the arrays of every thread that counted
+	long *base;	// the totals at the last disk_counters_reset, or NULL
+	int generation;	// changed by disk_counters_free
+};
+#define DISK_COUNTER_SET_INIT(n) { (n), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 }
+
+struct disk_counter_slot {
+	long *counters;
+	int generation;
+};
+
+/*Returns the counters of the calling thread in set, creating them on its first call.*/
+long *disk_counters( struct disk_counter_set *set, struct disk_counter_slot *slot );
+
+/*Adds n to counter, one of the calling thread; the atomic store is for the threads adding them up.*/
+#define DISK_COUNTER_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+
+/*Fills total (set->n longs) with the counters of all the threads added up, minus the totals at the last
+disk_counters_reset if since_reset is 1.*/
+void disk_counters_sum( struct disk_counter_set *set, long *total, int since_reset );
+
+/*Takes the current totals as the base that disk_counters_sum subtracts from then on.*/
+void disk_counters_reset( struct disk_counter_set *set );
+
+/*Frees the counters of all the threads; they get new ones on their next count. Must not run while
+other threads count in the set.*/
+void disk_counters_free( struct disk_counter_set *set );
+
+/*Returns the bucket of a histogram of nbuckets by log2 for value: bucket i holds the values from 2^i
+to 2^(i+1)-1, and the last one also those above.*/
+int disk_stats_bucket( unsigned long value, int nbuckets );
+
+/*Buckets of the histograms of disk_stats.*/
+#define DISK_STATS_BUCKETS 24
+
+/*Activity of the disk since disk_init or disk_stats_reset, added up over all the threads.*/
+struct disk_stats {
+	long reads;	// blocks read from the image
+	long writes;	// blocks written to the image
+	long read_ops;	// read system calls, each of one or more adjacent blocks; copies from the mapping with the mmap backend
+	long write_ops;	// same, for writes
+	long hits;	// block accesses served by the cache
+	long misses;	// block accesses not served by the cache
+	long ra_blocks;	// blocks prefetched by readahead
+	long ra_hits;	// prefetched blocks that were used
+	long ra_wasted;	// prefetched blocks evicted unused
+	long throttled_writes;	// writes that waited for the background flusher
+	long evictions_clean;	// cache entries reused for another block
+	long evictions_dirty;	// same, for entries that had to be written back first
+	long flushes;	// batches of dirty blocks written back: by disk_flush, disk_flush_cache or the background flusher
+	long flush_blocks;	// blocks written back by them
+	long flush_batch[DISK_STATS_BUCKETS];	// flushes by number of blocks
+};
+
+/*Fills stats with the activity of the disk so far; it may be called while other threads use the disk.*/
+void disk_stats( struct disk_stats *stats );
+
+/*Starts counting the activity of the disk from zero again.*/
+void disk_stats_reset();
+
+/*Block access trace. With the trace option, every access of disk_read_data, disk_write_data, the range and
+vector functions and disk_get_block is recorded, and so is every block of disk_discard: the trace file holds
+a disk_trace_header followed by disk_trace_records, in the order the threads filled their buffers rather than
+in time order. Accesses that bypass the cache (disk_read, disk_write, the block functions) and readahead are not recorded.*/
+#define DISK_TRACE_MAGIC 0x74726163
+
+/*Types of the trace records.*/
+#define DISK_TRACE_READ    0
+#define DISK_TRACE_WRITE   1	// the block was written, or pinned to be overwritten
+#define DISK_TRACE_DISCARD 2	// the block was discarded; hit is 0
+
+struct disk_trace_header {
+	unsigned int magic;	// DISK_TRACE_MAGIC
+	int nblocks;	// size of the disk
+	int cache_blocks;	// size of the cache that served the accesses
+	int cache_policy;	// and its policy, one of CACHE_POLICY_*
+};
+
+struct disk_trace_record {
+	unsigned long long time;	// ns since disk_init
+	int blocknum;
+	unsigned char type;	// one of DISK_TRACE_*
+	unsigned char hit;	// 1 if the cache served the access
+	unsigned short unused;
+};
+
 /*Function to be called at the end of the program.*/
 void disk_close();
 
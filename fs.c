@@ -7,30 +7,85 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
-#define FS_MAGIC           0xf0f03410
+#define FS_MAGIC           0xf0f03415
 #define INODES_PER_BLOCK   64
-#define POINTERS_PER_INODE 14
+#define DIRECT_POINTERS    11
 #define POINTERS_PER_BLOCK 1024
+// direct blocks, then the blocks of the indirect block, then those of the indirect blocks of the double indirect one
+#define MAX_FILE_BLOCKS    (DIRECT_POINTERS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define MAX_FILE_SIZE      ((long)MAX_FILE_BLOCKS * DISK_BLOCK_SIZE)
 
 struct fs_superblock {
 	unsigned int magic;
 	unsigned int nblocks;
 	unsigned int ninodeblocks;
 	unsigned int ninodes;
+	unsigned int njournalblocks;
+	unsigned int nbitmapblocks;
+	unsigned int clean;	// TRUE if the disk was unmounted: the bitmap blocks are up to date and the journal is in place
+	unsigned int journalsequence;	// sequence number of the next transaction, if clean
+	unsigned int initializedblocks;	// i-node blocks written since fs_format; the others are all non-valid
+	unsigned int layout;	// FS_LAYOUT_BLOCKS or FS_LAYOUT_EXTENTS, how i-nodes map their blocks
 };
 struct fs_superblock my_super;
 #define NUM_SUPERBLOCKS 1
 
+#define INLINE_EXTENTS     5
+#define BLOCK_EXTENTS      511
+
+/*Run of length consecutive blocks of a file, from block start on; start 0 is a hole of length blocks.
+The extents of a file follow each other from its first block, with no gaps.*/
+struct fs_extent {
+	unsigned int start;
+	unsigned int length;
+};
+
+// 64 bytes, the size first so that it is aligned
 struct fs_inode {
+	uint64_t size;
 	unsigned int isvalid;
-	unsigned int size;
-	unsigned int direct[POINTERS_PER_INODE];
+	union {
+		struct {	// FS_LAYOUT_BLOCKS
+			unsigned int direct[DIRECT_POINTERS];
+			unsigned int indirect;	// block of POINTERS_PER_BLOCK more block pointers; 0 if none
+			unsigned int dindirect;	// block of pointers to indirect blocks; 0 if none
+		};
+		struct {	// FS_LAYOUT_EXTENTS
+			unsigned int nextents;	// extents in extent[], while extentblock is 0
+			unsigned int extentblock;	// block that holds the extents once they do not fit in the i-node; 0 if none
+			struct fs_extent extent[INLINE_EXTENTS];
+		};
+	};
+};
+
+/*Extent block of a file; it keeps its own count, so it is consistent on disk whatever i-node points to it.*/
+struct fs_extent_block {
+	unsigned int nextents;
+	unsigned int unused;
+	struct fs_extent extent[BLOCK_EXTENTS];
+};
+
+#define JOURNAL_MAGIC      0x6a726e6c
+#define JOURNAL_MAX_BLOCKS 1020	// blocks of a transaction, as many as fit in its header
+
+/*First block of a journal transaction; it is followed by the new contents of the blocks it lists.*/
+struct fs_journal_header {
+	unsigned int magic;
+	unsigned int sequence;	// consecutive in the transactions to replay
+	unsigned int nblocks;
+	unsigned int checksum;	// of the header and the blocks, so a torn transaction is not replayed
+	unsigned int home[JOURNAL_MAX_BLOCKS];	// where each block goes
 };
 
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_journal_header journal;
+	struct fs_extent_block extents;
 	char data[DISK_BLOCK_SIZE];
 };
 
@@ -40,45 +95,1203 @@ union fs_block {
 #define VALID 1
 #define NON_VALID 0
 
-#define FREE 0
-#define NOT_FREE 1
-unsigned char * blockBitMap;
+/*Bitmap with one bit per block (or i-node); a set bit means the block is occupied.
+Searches go a 64-bit word at a time and start at a rotating next-fit hint.
+Bits are taken and released with atomic operations, so threads allocate without a lock.*/
+struct bitmap {
+	uint64_t* words;
+	unsigned int nbits;
+	unsigned int nwords;
+	unsigned int nfree;	// number of clear bits
+	unsigned int hint;	// word where the next search starts
+};
+struct bitmap blockBitMap;
+struct bitmap inodeBitMap;	// a set bit means the i-node is valid; built by fs_mount
+
+// The i-node table is kept in memory while the disk is mounted;
+// modified blocks are written back by fs_sync()
+union fs_block* inodeTable;
+unsigned char* inodeBlockDirty;	// set and cleared atomically
+
+// Every i-node has a reader/writer lock: fs_read/fs_pread read-lock the file's i-node,
+// fs_write/fs_pwrite/fs_delete write-lock it. fs_create finds free i-nodes in inodeBitMap,
+// whose bit fs_delete clears with the i-node still locked, and locks the i-node it takes.
+pthread_rwlock_t* inodeLocks;
+
+/*An open file pins its i-node in the in-memory i-node table;
+changes to the i-node are only persisted (its block marked dirty) by fs_close or fs_sync.
+It also keeps the disk block of the last block it accessed alone, so that transfers of parts of a block
+in a row map the block once: the blocks of a file do not move, and it cannot be deleted while it is open.*/
+struct fs_file {
+	int inumber;	// -1 if the handle is not in use
+	struct fs_inode *inode;
+	int dirty;	// set and cleared atomically
+	unsigned long current;	// file block << 32 | its disk block, 0 if none; loaded and stored atomically
+};
+struct fs_file openFiles[FS_MAX_OPEN_FILES];
+
+/*The changes to the i-node table reach it through a write-ahead journal, the blocks after the table:
+a commit writes the modified blocks as one transaction and syncs the disk once. They are only written
+in place (checkpointed) when the journal is full and at fs_unmount, the latest copy of each block once,
+so a block modified by many commits is written in place once. fs_mount replays the transactions,
+so the table is never left half updated.*/
+union fs_block* journalBuffer;	// copy of the journal: the transactions since the last checkpoint; all of it while it is replayed
+unsigned int journalHead;	// where the next transaction is written, relative to the journal
+unsigned int journalSequence;	// sequence number of the next transaction
+int *journalCopies;	// for each block of the superblock and the i-node table, where its latest copy is in the journal; -1 if none
+
+// Group commit: fs_sync callers that arrive while a commit runs are served together by the next one
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitDone = PTHREAD_COND_INITIALIZER;
+int commitRunning = FALSE;
+unsigned long commitsStarted = 0;	// commits that have started
+unsigned long commitsDone = 0;	// commits that have finished
+// Protects the handle table; it may be taken with an i-node locked, but not the other way around
+pthread_mutex_t filesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Runs of blocks of deleted files. They stay occupied until the commit that journals the deletes has synced
+the disk: a crash before it brings the files back, with the data and pointer blocks they had.*/
+struct blockRuns {
+	unsigned int *blocks;
+	unsigned int *counts;
+	int n;
+	int capacity;
+};
+struct blockRuns freedRuns;	// to be freed by the next commit
+pthread_mutex_t freedLock = PTHREAD_MUTEX_INITIALIZER;	// taken with an i-node locked, not the other way around
+static __thread struct blockRuns *deletedRuns;	// where releaseBlocks puts the blocks of the file being deleted
+
+/*Runs of blocks whose deletes are on disk, discarded and freed together once there are discardBatch blocks
+(DISCARD_BATCH at most), when the free blocks run short, and at fs_unmount: the host file releases adjacent runs
+with a single call, and far fewer calls than deletes.*/
+#define DISCARD_BATCH 1024
+struct blockRuns discardRuns;
+unsigned int discardBlocks = 0;	// in discardRuns
+unsigned int discardBatch;
+pthread_mutex_t discardLock = PTHREAD_MUTEX_INITIALIZER;	// may be taken with an i-node locked
+
+/*Creates a bitmap with nbits clear bits.*/
+void bitmap_create(struct bitmap* map, unsigned int nbits) {
+	map->nbits = nbits;
+	map->nwords = (nbits + 63) / 64;
+	map->words = (uint64_t*)calloc(map->nwords > 0 ? map->nwords : 1, sizeof(uint64_t));
+	map->nfree = nbits;
+	map->hint = 0;
+	// the bits past the end of the last word are set, so they are never allocated
+	if (nbits % 64 != 0) {
+		map->words[map->nwords - 1] = ~(uint64_t)0 << (nbits % 64);
+	}
+}
+
+void bitmap_destroy(struct bitmap* map) {
+	free(map->words);
+	map->words = NULL;
+	map->nbits = map->nwords = map->nfree = map->hint = 0;
+}
+
+int bitmap_test(struct bitmap* map, unsigned int bit) {
+	return (__atomic_load_n(&map->words[bit / 64], __ATOMIC_ACQUIRE) >> (bit % 64)) & 1;
+}
+
+/*Marks bit as occupied; bits past the end of the map are ignored.*/
+void bitmap_set(struct bitmap* map, unsigned int bit) {
+	if (bit >= map->nbits) {
+		return;
+	}
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	if (!(__atomic_fetch_or(&map->words[bit / 64], mask, __ATOMIC_ACQ_REL) & mask)) {
+		__atomic_sub_fetch(&map->nfree, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*Marks bit as free.*/
+void bitmap_clear(struct bitmap* map, unsigned int bit) {
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	if (__atomic_fetch_and(&map->words[bit / 64], ~mask, __ATOMIC_ACQ_REL) & mask) {
+		__atomic_add_fetch(&map->nfree, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*Marks bit as occupied if it is free. Returns TRUE if it was free.*/
+int bitmap_take(struct bitmap* map, unsigned int bit) {
+	if (bit >= map->nbits) {
+		return FALSE;
+	}
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	if (__atomic_fetch_or(&map->words[bit / 64], mask, __ATOMIC_ACQ_REL) & mask) {
+		return FALSE;
+	}
+	__atomic_sub_fetch(&map->nfree, 1, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/*Finds a free bit starting at the hint, marks it as occupied and returns it.
+A bit is taken with a compare-and-swap of its word; if another thread changed the word first,
+the search goes on with the new value. Returns -1 if there are no free bits.
+If scanned is not NULL, stores in it how many words the search went through.*/
+int bitmap_alloc(struct bitmap* map, unsigned int* scanned) {
+	unsigned int ignored;
+	if (scanned == NULL) {
+		scanned = &ignored;
+	}
+	*scanned = 0;
+	if (__atomic_load_n(&map->nfree, __ATOMIC_RELAXED) == 0) {
+		return -1;
+	}
+	unsigned int w = __atomic_load_n(&map->hint, __ATOMIC_RELAXED);
+	for (unsigned int n = 0; n < map->nwords; n++) {
+		uint64_t word = __atomic_load_n(&map->words[w], __ATOMIC_ACQUIRE);
+		while (word != ~(uint64_t)0) {
+			unsigned int bit = __builtin_ctzll(~word);
+			if (__atomic_compare_exchange_n(&map->words[w], &word, word | ((uint64_t)1 << bit),
+					0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_sub_fetch(&map->nfree, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&map->hint, w, __ATOMIC_RELAXED);
+				*scanned = n + 1;
+				return w * 64 + bit;
+			}
+		}
+		if (++w == map->nwords) {
+			w = 0;
+		}
+	}
+	*scanned = map->nwords;
+	return -1;
+}
+
+/*Loads the bitmap from the nblocks blocks starting at start, with a single I/O.*/
+void bitmap_load(struct bitmap* map, int start, int nblocks) {
+	char* buffer;
+	if (posix_memalign((void**)&buffer, DISK_BLOCK_SIZE, (size_t)nblocks * DISK_BLOCK_SIZE) != 0) {
+		printf("out of memory\n");
+		abort();
+	}
+	disk_read_blocks(start, nblocks, buffer);
+	memcpy(map->words, buffer, map->nwords * sizeof(uint64_t));
+	free(buffer);
+	map->nfree = 0;
+	for (unsigned int w = 0; w < map->nwords; w++) {
+		map->nfree += __builtin_popcountll(~map->words[w]);
+	}
+	map->hint = 0;
+}
+
+/*Writes the bitmap to the nblocks blocks starting at start, with a single I/O.*/
+void bitmap_save(struct bitmap* map, int start, int nblocks) {
+	char* buffer;
+	if (posix_memalign((void**)&buffer, DISK_BLOCK_SIZE, (size_t)nblocks * DISK_BLOCK_SIZE) != 0) {
+		printf("out of memory\n");
+		abort();
+	}
+	bzero(buffer, (size_t)nblocks * DISK_BLOCK_SIZE);
+	memcpy(buffer, map->words, map->nwords * sizeof(uint64_t));
+	disk_write_blocks(start, nblocks, buffer);
+	free(buffer);
+}
+
+long min(long a, long b) {
+	if (a < b) {
+		return a;
+	} else {
+		return b;
+	}
+}
+
+/*Statistics, counted per thread like those of the disk: struct fs_stats is made of longs only.*/
+static struct disk_counter_set statsCounters = DISK_COUNTER_SET_INIT(sizeof(struct fs_stats) / sizeof(long));
+static __thread struct disk_counter_slot myCounters;
+
+/*Returns the counters of the calling thread, creating them on its first operation.*/
+static struct fs_stats *threadStats()
+{
+	return (struct fs_stats*)disk_counters(&statsCounters, &myCounters);
+}
+
+static long nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*Counts a call of an operation that started at start (nowNs) and transferred bytes, or failed.*/
+static void countOp( struct fs_op_stats *op, int failed, long bytes, long start )
+{
+	DISK_COUNTER_ADD(op->count, 1);
+	if (failed) {
+		DISK_COUNTER_ADD(op->errors, 1);
+	}
+	DISK_COUNTER_ADD(op->bytes, bytes);
+	DISK_COUNTER_ADD(op->latency[disk_stats_bucket(nowNs() - start, FS_STATS_BUCKETS)], 1);
+}
+
+/*Counts a search for a free block that went through scanned words of the map.*/
+static void countAllocation( unsigned int scanned )
+{
+	struct fs_stats *stats = threadStats();
+	DISK_COUNTER_ADD(stats->allocations, 1);
+	DISK_COUNTER_ADD(stats->alloc_words, scanned);
+	DISK_COUNTER_ADD(stats->alloc_scan[disk_stats_bucket(scanned, FS_STATS_BUCKETS)], 1);
+}
+
+void fs_stats( struct fs_stats *stats )
+{
+	disk_counters_sum(&statsCounters, (long*)stats, TRUE);
+}
+
+void fs_stats_reset()
+{
+	disk_counters_reset(&statsCounters);
+}
+
+/*Returns the i-node inumber in the in-memory i-node table.*/
+struct fs_inode *inodeRef( int inumber )
+{
+	if (inumber >= my_super.ninodes) {
+		printf("inode number too big \n");
+		abort();
+	}
+	return &inodeTable[inumber / INODES_PER_BLOCK].inode[inumber % INODES_PER_BLOCK];
+}
+
+/*Marks the block of the i-node table that holds inumber as modified.*/
+void markInodeDirty( int inumber )
+{
+	__atomic_store_n(&inodeBlockDirty[inumber / INODES_PER_BLOCK], TRUE, __ATOMIC_RELEASE);
+}
+
+/*Copies block i of the i-node table into block, read-locking each i-node while it is copied.*/
+void copyInodeBlock( int i, union fs_block *block )
+{
+	for (int j = 0; j < INODES_PER_BLOCK; j++) {
+		int inumber = i * INODES_PER_BLOCK + j;
+		pthread_rwlock_rdlock(&inodeLocks[inumber]);
+		block->inode[j] = inodeTable[i].inode[j];
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
+	}
+}
+
+/**************************************************************/
+/* Block map of a file */
+
+// Layout of the i-nodes being mapped: the mounted disk's, or that of the disk fs_debug reads
+unsigned int inodeLayout;
+
+int getFreeBlock(){
+	unsigned int scanned;
+	int block = bitmap_alloc(&blockBitMap, &scanned); /* -1 se nao ha' blocos livres */
+	countAllocation(scanned);
+	return block;
+}
+
+// Blocks already taken from blockBitMap that the calling thread hands out, in order, as new data blocks
+static __thread unsigned int reservedNext;
+static __thread int reservedLeft;
+
+/*Returns a block for new file data: the next block of the thread's reserved run if it has one,
+otherwise goal (if not 0 and free), otherwise any free block; -1 if there are no free blocks.*/
+int newDataBlock( unsigned int goal )
+{
+	if (reservedLeft > 0) {
+		reservedLeft--;
+		return reservedNext++;
+	}
+	if (goal != 0 && bitmap_take(&blockBitMap, goal)) {
+		return goal;
+	}
+	return getFreeBlock();
+}
+
+/*mapRun for FS_LAYOUT_BLOCKS. Pointer blocks are read through the cache and pinned once for the whole run,
+so sequential transfers do not look them up block by block.*/
+int mapPointers( struct fs_inode *inode, int fileBlock, int max, unsigned int *diskBlock )
+{
+	unsigned int *pointers;	// the pointers of the part of the map fileBlock is in
+	unsigned int *pinned = NULL;	// pointer block to release
+	int index, limit;
+
+	if (fileBlock < DIRECT_POINTERS) {
+		pointers = inode->direct;
+		index = fileBlock;
+		limit = DIRECT_POINTERS;
+	} else if (fileBlock < DIRECT_POINTERS + POINTERS_PER_BLOCK) {
+		index = fileBlock - DIRECT_POINTERS;
+		limit = POINTERS_PER_BLOCK;
+		if (inode->indirect == 0) {
+			*diskBlock = 0;
+			return min(max, limit - index);
+		}
+		pointers = pinned = (unsigned int*)disk_get_block(inode->indirect, DISK_GET_READ);
+	} else {
+		int n = fileBlock - DIRECT_POINTERS - POINTERS_PER_BLOCK;
+		index = n % POINTERS_PER_BLOCK;
+		limit = POINTERS_PER_BLOCK;
+		unsigned int indirect = 0;
+		if (inode->dindirect != 0) {
+			unsigned int *dpointers = (unsigned int*)disk_get_block(inode->dindirect, DISK_GET_READ);
+			indirect = dpointers[n / POINTERS_PER_BLOCK];
+			disk_put_block((char*)dpointers, FALSE);
+		}
+		if (indirect == 0) {
+			*diskBlock = 0;
+			return min(max, limit - index);
+		}
+		pointers = pinned = (unsigned int*)disk_get_block(indirect, DISK_GET_READ);
+	}
+
+	unsigned int first = pointers[index];
+	int run = 1;
+	while (run < max && index + run < limit
+			&& pointers[index + run] == (first == 0 ? 0 : first + run)) {
+		run++;
+	}
+	if (pinned != NULL) {
+		disk_put_block((char*)pinned, FALSE);
+	}
+	*diskBlock = first;
+	return run;
+}
+
+/*Returns the block in *slot, allocating one if it is 0. A new pointer block is zeroed in the cache.
+Returns -1 if there are no free blocks.*/
+int allocateSlot( unsigned int *slot, int pointerBlock )
+{
+	if (*slot != 0) {
+		return *slot;
+	}
+	int newEntry = pointerBlock ? getFreeBlock() : newDataBlock(0);
+	if (newEntry == -1) {
+		return -1;
+	}
+	if (pointerBlock) {
+		char *block = disk_get_block(newEntry, DISK_GET_WRITE);
+		bzero(block, DISK_BLOCK_SIZE);
+		disk_put_block(block, TRUE);
+	}
+	*slot = newEntry;
+	return newEntry;
+}
+
+/*Returns the block in slot index of the pointer block blocknum, allocating it as allocateSlot does.*/
+int allocateInPointerBlock( int blocknum, int index, int pointerBlock )
+{
+	unsigned int *pointers = (unsigned int*)disk_get_block(blocknum, DISK_GET_READ);
+	unsigned int before = pointers[index];
+	int result = allocateSlot(&pointers[index], pointerBlock);
+	disk_put_block((char*)pointers, pointers[index] != before);
+	return result;
+}
+
+/*blockForWrite for FS_LAYOUT_BLOCKS: the pointer blocks that lead to a new block are allocated too.*/
+int pointerForWrite( struct fs_inode *inode, int fileBlock )
+{
+	if (fileBlock < DIRECT_POINTERS) {
+		return allocateSlot(&inode->direct[fileBlock], FALSE);
+	}
+	fileBlock -= DIRECT_POINTERS;
+	if (fileBlock < POINTERS_PER_BLOCK) {
+		if (allocateSlot(&inode->indirect, TRUE) == -1) {
+			return -1;
+		}
+		return allocateInPointerBlock(inode->indirect, fileBlock, FALSE);
+	}
+	fileBlock -= POINTERS_PER_BLOCK;
+	if (allocateSlot(&inode->dindirect, TRUE) == -1) {
+		return -1;
+	}
+	int indirect = allocateInPointerBlock(inode->dindirect, fileBlock / POINTERS_PER_BLOCK, TRUE);
+	if (indirect == -1) {
+		return -1;
+	}
+	return allocateInPointerBlock(indirect, fileBlock % POINTERS_PER_BLOCK, FALSE);
+}
+
+/*visitFileBlocks for FS_LAYOUT_BLOCKS: the data blocks, then the pointer blocks.*/
+void visitPointers( struct fs_inode *inode, void (*visit)( int block, int count ) )
+{
+	int nFileBlocks = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	for (int fileBlock = 0; fileBlock < nFileBlocks; ) {
+		unsigned int diskBlock;
+		int run = mapPointers(inode, fileBlock, nFileBlocks - fileBlock, &diskBlock);
+		if (diskBlock != 0) {
+			visit(diskBlock, run);
+		}
+		fileBlock += run;
+	}
+	if (inode->indirect != 0) {
+		visit(inode->indirect, 1);
+	}
+	if (inode->dindirect != 0) {
+		unsigned int pointers[POINTERS_PER_BLOCK];
+		char *block = disk_get_block(inode->dindirect, DISK_GET_READ);
+		memcpy(pointers, block, DISK_BLOCK_SIZE);
+		disk_put_block(block, FALSE);
+		for (int i = 0; i < POINTERS_PER_BLOCK; i++) {
+			if (pointers[i] != 0) {
+				visit(pointers[i], 1);
+			}
+		}
+		visit(inode->dindirect, 1);
+	}
+}
+
+/*Returns the extents of the file and stores in *count where their number is. They are in the i-node,
+or in its extent block, which is then pinned in *pinned (NULL otherwise) until the caller puts it.*/
+struct fs_extent *extentList( struct fs_inode *inode, unsigned int **count, union fs_block **pinned )
+{
+	if (inode->extentblock == 0) {
+		*pinned = NULL;
+		*count = &inode->nextents;
+		return inode->extent;
+	}
+	*pinned = (union fs_block*)disk_get_block(inode->extentblock, DISK_GET_READ);
+	*count = &(*pinned)->extents.nextents;
+	return (*pinned)->extents.extent;
+}
+
+/*mapRun for FS_LAYOUT_EXTENTS: the run is the rest of the extent fileBlock is in;
+past the last extent the file is a hole.*/
+int mapExtents( struct fs_inode *inode, int fileBlock, int max, unsigned int *diskBlock )
+{
+	unsigned int *count;
+	union fs_block *pinned;
+	struct fs_extent *list = extentList(inode, &count, &pinned);
+	unsigned int position = 0;	// file block where extent i starts
+	int run = max;
+
+	*diskBlock = 0;
+	for (unsigned int i = 0; i < *count; i++) {
+		if (fileBlock < position + list[i].length) {
+			unsigned int offset = fileBlock - position;
+			*diskBlock = list[i].start == 0 ? 0 : list[i].start + offset;
+			run = min(max, list[i].length - offset);
+			break;
+		}
+		position += list[i].length;
+	}
+	if (pinned != NULL) {
+		disk_put_block(pinned->data, FALSE);
+	}
+	return run;
+}
+
+/*Appends length blocks from start (0 for a hole) to the n extents in list, extending the last one if they continue it.*/
+void appendExtent( struct fs_extent *list, unsigned int *n, unsigned int start, unsigned int length )
+{
+	if (length == 0) {
+		return;
+	}
+	if (*n > 0) {
+		struct fs_extent *last = &list[*n - 1];
+		if (start == 0 ? last->start == 0 : last->start != 0 && last->start + last->length == start) {
+			last->length += length;
+			return;
+		}
+	}
+	list[*n].start = start;
+	list[*n].length = length;
+	(*n)++;
+}
+
+/*blockForWrite for FS_LAYOUT_EXTENTS. A new block is taken right after the one before it in the file
+if that is free, so that a file written in order stays a single extent.
+The extents move to an extent block when they no longer fit in the i-node.
+Returns -1 if there are no free blocks or the file has too many extents.*/
+int extentForWrite( struct fs_inode *inode, int fileBlock )
+{
+	unsigned int *count;
+	union fs_block *pinned;
+	struct fs_extent *list = extentList(inode, &count, &pinned);
+	unsigned int position = 0;	// file block where extent i starts
+	unsigned int i;
+
+	for (i = 0; i < *count && fileBlock >= position + list[i].length; i++) {
+		position += list[i].length;
+	}
+	if (i < *count && list[i].start != 0) {
+		int diskBlock = list[i].start + fileBlock - position;
+		if (pinned != NULL) {
+			disk_put_block(pinned->data, FALSE);
+		}
+		return diskBlock;
+	}
+
+	// a hole, or past the end of the extents: the previous file block is the end of extent i-1 if this one starts a hole
+	unsigned int goal = 0;
+	if (i > 0 && fileBlock == position && list[i - 1].start != 0) {
+		goal = list[i - 1].start + list[i - 1].length;
+	}
+	int newBlock = newDataBlock(goal);
+	if (newBlock == -1) {
+		if (pinned != NULL) {
+			disk_put_block(pinned->data, FALSE);
+		}
+		return -1;
+	}
+
+	if (i == *count && fileBlock == position && goal == newBlock) {
+		// appended to the file right after its last extent, the usual case
+		list[i - 1].length++;
+		if (pinned != NULL) {
+			disk_put_block(pinned->data, TRUE);
+		}
+		return newBlock;
+	}
+
+	// extent i (a hole, or none) becomes the hole before fileBlock, the new block and the hole after it
+	struct fs_extent updated[BLOCK_EXTENTS + 3];
+	unsigned int n = 0;
+	for (unsigned int j = 0; j < i; j++) {
+		appendExtent(updated, &n, list[j].start, list[j].length);
+	}
+	appendExtent(updated, &n, 0, fileBlock - position);
+	appendExtent(updated, &n, newBlock, 1);
+	if (i < *count) {
+		appendExtent(updated, &n, 0, position + list[i].length - fileBlock - 1);
+		for (unsigned int j = i + 1; j < *count; j++) {
+			appendExtent(updated, &n, list[j].start, list[j].length);
+		}
+	}
+
+	if (n > BLOCK_EXTENTS || (pinned == NULL && n > INLINE_EXTENTS && allocateSlot(&inode->extentblock, TRUE) == -1)) {
+		bitmap_clear(&blockBitMap, newBlock);
+		if (pinned != NULL) {
+			disk_put_block(pinned->data, FALSE);
+		}
+		return -1;
+	}
+	if (pinned == NULL && inode->extentblock != 0) {
+		inode->nextents = 0;
+		list = extentList(inode, &count, &pinned);
+	}
+	memcpy(list, updated, n * sizeof(struct fs_extent));
+	*count = n;
+	if (pinned != NULL) {
+		disk_put_block(pinned->data, TRUE);
+	}
+	return newBlock;
+}
+
+/*visitFileBlocks for FS_LAYOUT_EXTENTS: every extent with blocks, then the extent block.*/
+void visitExtents( struct fs_inode *inode, void (*visit)( int block, int count ) )
+{
+	struct fs_extent extents[BLOCK_EXTENTS];
+	unsigned int *count;
+	union fs_block *pinned;
+	struct fs_extent *list = extentList(inode, &count, &pinned);
+	unsigned int n = *count;
+
+	memcpy(extents, list, n * sizeof(struct fs_extent));
+	if (pinned != NULL) {
+		disk_put_block(pinned->data, FALSE);
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		if (extents[i].start != 0) {
+			visit(extents[i].start, extents[i].length);
+		}
+	}
+	if (inode->extentblock != 0) {
+		visit(inode->extentblock, 1);
+	}
+}
+
+/*Finds block fileBlock of the file on disk: stores in *diskBlock its disk block, 0 for a hole, and returns
+how many of the (at most max) file blocks from fileBlock on continue it: consecutive on disk, or all holes.*/
+int mapRun( struct fs_inode *inode, int fileBlock, int max, unsigned int *diskBlock )
+{
+	if (inodeLayout == FS_LAYOUT_EXTENTS) {
+		return mapExtents(inode, fileBlock, max, diskBlock);
+	}
+	return mapPointers(inode, fileBlock, max, diskBlock);
+}
+
+/*Returns the disk block of block fileBlock of the file, allocating it if it is a hole.
+Returns -1 if there are no free blocks.*/
+int blockForWrite( struct fs_inode *inode, int fileBlock )
+{
+	if (inodeLayout == FS_LAYOUT_EXTENTS) {
+		return extentForWrite(inode, fileBlock);
+	}
+	return pointerForWrite(inode, fileBlock);
+}
+
+/*mapRun through the handle file, or NULL: a single block found in the block it keeps is not looked up again.
+Holes are not kept, since they get blocks.*/
+int mapFileRun( struct fs_file *file, struct fs_inode *inode, int fileBlock, int max, unsigned int *diskBlock )
+{
+	if (file == NULL) {
+		return mapRun(inode, fileBlock, max, diskBlock);
+	}
+	unsigned long current = __atomic_load_n(&file->current, __ATOMIC_RELAXED);
+	if (max == 1 && current != 0 && (int)(current >> 32) == fileBlock) {
+		*diskBlock = (unsigned int)current;
+		return 1;
+	}
+	int run = mapRun(inode, fileBlock, max, diskBlock);
+	if (*diskBlock != 0) {
+		__atomic_store_n(&file->current, (unsigned long)fileBlock << 32 | *diskBlock, __ATOMIC_RELAXED);
+	}
+	return run;
+}
+
+/*Calls visit(block, count) for every run of consecutive disk blocks of the file,
+its data blocks and the blocks that map them.*/
+void visitFileBlocks( struct fs_inode *inode, void (*visit)( int block, int count ) )
+{
+	if (inodeLayout == FS_LAYOUT_EXTENTS) {
+		visitExtents(inode, visit);
+	} else {
+		visitPointers(inode, visit);
+	}
+}
+
+/**************************************************************/
+/* Delayed allocation */
+
+#define DELAYED_LIMIT 4096	// delayed pages of all the files above which a writer allocates those of its file
+#define DELAYED_BATCH 256	// blocks written by each disk_writev of allocateDelayed
+
+/*Data written to holes of a file, kept in memory without disk blocks until allocateDelayed chooses them
+for all the pages at once, so the blocks of a file are contiguous even if other files grow at the same time.
+This happens when the file system is synced, and, with the disk's background flusher, once the pages are as old as
+the dirty blocks it writes back or there are more of them than it lets stay dirty in the cache.
+Each page reserves a block, so the allocation cannot run out of them. It is protected by the lock of the i-node,
+and it is in delayedList (under delayedLock) while it has pages.*/
+struct delayedFile {
+	int inumber;
+	int npages;
+	int capacity;
+	long since;	// nowNs when its first page was added
+	unsigned int *fileBlocks;	// in increasing order
+	char **pages;	// page i holds file block fileBlocks[i]
+	struct delayedFile *prev, *next;
+};
+struct delayedFile **delayedFiles;	// for each i-node, its delayed pages or NULL
+struct delayedFile *delayedList;
+pthread_mutex_t delayedLock = PTHREAD_MUTEX_INITIALIZER;	// taken with an i-node locked, not the other way around
+unsigned int delayedPages = 0;	// pages of all the files
+unsigned int reservedBlocks = 0;	// free blocks promised to delayed pages
+int delayedBackground = -1;	// pages above which the flusher allocates them all; -1 until it runs
+
+/*Reserves a free block for a delayed page, keeping some more free for the pointer and extent blocks
+that mapping the pages may need. Returns FALSE if there are not enough free blocks.*/
+int reserveBlock()
+{
+	unsigned int reserved = __atomic_add_fetch(&reservedBlocks, 1, __ATOMIC_RELAXED);
+	if (reserved + reserved / 256 + 8 > __atomic_load_n(&blockBitMap.nfree, __ATOMIC_RELAXED)) {
+		__atomic_sub_fetch(&reservedBlocks, 1, __ATOMIC_RELAXED);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*Returns the index of the first page of d for a file block not below fileBlock.*/
+int findPage( struct delayedFile *d, unsigned int fileBlock )
+{
+	int low = 0, high = d->npages;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		if (d->fileBlocks[middle] < fileBlock) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/*Returns the delayed page of file block fileBlock of the file inumber, or NULL if it has none.*/
+char *delayedPage( int inumber, unsigned int fileBlock )
+{
+	struct delayedFile *d = delayedFiles[inumber];
+	if (d == NULL) {
+		return NULL;
+	}
+	int i = findPage(d, fileBlock);
+	return i < d->npages && d->fileBlocks[i] == fileBlock ? d->pages[i] : NULL;
+}
+
+/*Returns the delayed page of file block fileBlock of the file inumber, adding a page of zeros if it has none.
+Returns NULL if no block can be reserved for it.*/
+char *addDelayedPage( int inumber, unsigned int fileBlock )
+{
+	struct delayedFile *d = delayedFiles[inumber];
+	char *page;
+
+	if (d != NULL) {
+		int i = findPage(d, fileBlock);
+		if (i < d->npages && d->fileBlocks[i] == fileBlock) {
+			return d->pages[i];
+		}
+	}
+	if (!reserveBlock()) {
+		return NULL;
+	}
+	if (posix_memalign((void**)&page, DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) != 0) {
+		printf("out of memory\n");
+		abort();
+	}
+	bzero(page, DISK_BLOCK_SIZE);
+	if (d == NULL) {
+		d = (struct delayedFile*)calloc(1, sizeof(struct delayedFile));
+		d->inumber = inumber;
+		d->since = nowNs();
+		delayedFiles[inumber] = d;
+		pthread_mutex_lock(&delayedLock);
+		d->next = delayedList;
+		if (delayedList != NULL) {
+			delayedList->prev = d;
+		}
+		delayedList = d;
+		pthread_mutex_unlock(&delayedLock);
+	}
+	if (d->npages == d->capacity) {
+		d->capacity = d->capacity == 0 ? 16 : 2 * d->capacity;
+		d->fileBlocks = (unsigned int*)realloc(d->fileBlocks, d->capacity * sizeof(unsigned int));
+		d->pages = (char**)realloc(d->pages, d->capacity * sizeof(char*));
+	}
+	// files are mostly written in order, so the page usually goes at the end
+	int i = findPage(d, fileBlock);
+	memmove(&d->fileBlocks[i + 1], &d->fileBlocks[i], (d->npages - i) * sizeof(unsigned int));
+	memmove(&d->pages[i + 1], &d->pages[i], (d->npages - i) * sizeof(char*));
+	d->fileBlocks[i] = fileBlock;
+	d->pages[i] = page;
+	d->npages++;
+	__atomic_add_fetch(&delayedPages, 1, __ATOMIC_RELAXED);
+	return page;
+}
+
+/*Frees the first count pages of the delayed file of inumber, and the delayed file itself once it has none.*/
+void dropDelayedPages( int inumber, int count )
+{
+	struct delayedFile *d = delayedFiles[inumber];
+	for (int i = 0; i < count; i++) {
+		free(d->pages[i]);
+	}
+	d->npages -= count;
+	memmove(d->fileBlocks, d->fileBlocks + count, d->npages * sizeof(unsigned int));
+	memmove(d->pages, d->pages + count, d->npages * sizeof(char*));
+	__atomic_sub_fetch(&delayedPages, count, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&reservedBlocks, count, __ATOMIC_RELAXED);
+	if (d->npages > 0) {
+		return;
+	}
+	pthread_mutex_lock(&delayedLock);
+	if (d->prev != NULL) {
+		d->prev->next = d->next;
+	} else {
+		delayedList = d->next;
+	}
+	if (d->next != NULL) {
+		d->next->prev = d->prev;
+	}
+	pthread_mutex_unlock(&delayedLock);
+	free(d->fileBlocks);
+	free(d->pages);
+	free(d);
+	delayedFiles[inumber] = NULL;
+}
+
+/*Gives the delayed pages of the file inumber, whose i-node is write-locked, their disk blocks and writes them.
+Each run of consecutive file blocks gets a run of free blocks, starting right after the block before it
+in the file when possible, and is written with as few I/Os as possible.
+Returns 0 if success; -1 if some pages could not be mapped, which keep waiting for their blocks.*/
+int allocateDelayed( int inumber )
+{
+	struct delayedFile *d = delayedFiles[inumber];
+	struct fs_inode *inode = inodeRef(inumber);
+	int blocknums[DELAYED_BATCH];
+
+	if (d == NULL) {
+		return 0;
+	}
+	markInodeDirty(inumber);
+	while (d != NULL) {
+		unsigned int fileBlock = d->fileBlocks[0];
+		int length = 1;
+		while (length < d->npages && length < DELAYED_BATCH && d->fileBlocks[length] == fileBlock + length) {
+			length++;
+		}
+		unsigned int goal = 0;
+		if (fileBlock > 0) {
+			mapRun(inode, fileBlock - 1, 1, &goal);
+			if (goal != 0) {
+				goal++;
+			}
+		}
+		int start = newDataBlock(goal);
+		if (start == -1) {
+			printf("file %d: no free blocks for its delayed pages\n", inumber);
+			return -1;
+		}
+		int taken = 1;
+		while (taken < length && bitmap_take(&blockBitMap, start + taken)) {
+			taken++;
+		}
+		// blockForWrite hands out the run, then the blocks it did not use are freed
+		reservedNext = start;
+		reservedLeft = taken;
+		int mapped = 0;
+		while (mapped < taken && blockForWrite(inode, fileBlock + mapped) != -1) {
+			blocknums[mapped] = start + mapped;
+			mapped++;
+		}
+		while (reservedLeft > 0) {
+			bitmap_clear(&blockBitMap, reservedNext++);
+			reservedLeft--;
+		}
+		if (mapped == 0) {
+			printf("file %d: cannot map its delayed pages\n", inumber);
+			return -1;
+		}
+		disk_writev(blocknums, mapped, d->pages);
+		dropDelayedPages(inumber, mapped);
+		d = delayedFiles[inumber];
+	}
+	return 0;
+}
+
+/*Returns the i-nodes of the files with delayed pages that were added olderThan ns ago or earlier, and stores
+their number in *n. The caller frees the array.*/
+int *delayedInodes( long olderThan, int *n )
+{
+	long now = nowNs();
+	*n = 0;
+	pthread_mutex_lock(&delayedLock);
+	for (struct delayedFile *d = delayedList; d != NULL; d = d->next) {
+		(*n)++;
+	}
+	int *inumbers = (int*)malloc((*n > 0 ? *n : 1) * sizeof(int));
+	*n = 0;
+	for (struct delayedFile *d = delayedList; d != NULL; d = d->next) {
+		if (now - d->since >= olderThan) {
+			inumbers[(*n)++] = d->inumber;
+		}
+	}
+	pthread_mutex_unlock(&delayedLock);
+	return inumbers;
+}
+
+/*Allocates the delayed pages of every file. Returns 0 if success; -1 if some pages could not be mapped.*/
+int allocateAllDelayed()
+{
+	int n, result = 0;
+	int *inumbers = delayedInodes(0, &n);
+	for (int i = 0; i < n; i++) {
+		pthread_rwlock_wrlock(&inodeLocks[inumbers[i]]);
+		if (allocateDelayed(inumbers[i]) < 0) {
+			result = -1;
+		}
+		pthread_rwlock_unlock(&inodeLocks[inumbers[i]]);
+	}
+	free(inumbers);
+	return result;
+}
+
+/*Starts a round of the disk's flusher if there are more delayed pages than it lets stay dirty.
+Called by the writers once they have unlocked their i-node, which the flusher would skip.*/
+void wakeWriteback()
+{
+	int background = __atomic_load_n(&delayedBackground, __ATOMIC_RELAXED);
+	if (background >= 0 && __atomic_load_n(&delayedPages, __ATOMIC_RELAXED) > background) {
+		disk_writeback_wake();
+	}
+}
+
+/*Writeback hook of the disk, run by its flusher: allocates the delayed pages of the files whose pages
+are older than expireMs, or of all the files while there are more than background pages.
+The files being written are skipped: the writer may be waiting for the flusher.*/
+void writebackDelayed( long expireMs, int background )
+{
+	__atomic_store_n(&delayedBackground, background, __ATOMIC_RELAXED);
+	int over = __atomic_load_n(&delayedPages, __ATOMIC_RELAXED) > background;
+	int n;
+	int *inumbers = delayedInodes(over ? 0 : expireMs * 1000000, &n);
+	for (int i = 0; i < n; i++) {
+		if (pthread_rwlock_trywrlock(&inodeLocks[inumbers[i]]) == 0) {
+			allocateDelayed(inumbers[i]);
+			pthread_rwlock_unlock(&inodeLocks[inumbers[i]]);
+		}
+	}
+	free(inumbers);
+}
+
+/*Returns the first block of the journal.*/
+int journalStart()
+{
+	return NUM_SUPERBLOCKS + my_super.ninodeblocks;
+}
+
+/*Returns the first block of the bitmap of free/occupied blocks, saved by fs_unmount.*/
+int bitmapStart()
+{
+	return journalStart() + my_super.njournalblocks;
+}
+
+/*Returns the first block that is not file system metadata.*/
+int firstDataBlock()
+{
+	return bitmapStart() + my_super.nbitmapblocks;
+}
+
+/*Fills block with the superblock of the mounted disk, with its clean flag set to clean.*/
+void fillSuperblock( union fs_block *block, int clean )
+{
+	bzero(block->data, DISK_BLOCK_SIZE);
+	block->super = my_super;
+	block->super.clean = clean;
+	block->super.journalsequence = journalSequence;
+}
+
+/*Writes the superblock, with its clean flag set to clean.*/
+void writeSuperblock( int clean )
+{
+	union fs_block block;
+	fillSuperblock(&block, clean);
+	disk_write(0, block.data);
+}
+
+/*Returns the checksum (FNV-1a) of the transaction that starts with header, its checksum field excluded.*/
+unsigned int journalChecksum( union fs_block *header )
+{
+	unsigned int hash = 2166136261u;
+	unsigned int saved = header->journal.checksum;
+	header->journal.checksum = 0;
+	const unsigned char *bytes = (const unsigned char*)header;
+	size_t length = (size_t)(1 + header->journal.nblocks) * DISK_BLOCK_SIZE;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	header->journal.checksum = saved;
+	return hash;
+}
+
+/*Writes the blocks of a transaction in place, runs of consecutive blocks with a single I/O.*/
+void checkpoint( union fs_block *header )
+{
+	int n = header->journal.nblocks;
+	for (int k = 0; k < n; ) {
+		int run = 1;
+		while (k + run < n && header->journal.home[k + run] == header->journal.home[k] + run) {
+			run++;
+		}
+		disk_write_blocks(header->journal.home[k], run, header[1 + k].data);
+		k += run;
+	}
+}
+
+/*Replays the valid transactions at the start of the journal, a chain of consecutive sequence numbers,
+reading the whole journal with one I/O. The next transaction is written at the start of the journal,
+with a sequence number above all the ones in it, so no stale transaction can continue the new chain.*/
+void replayJournal()
+{
+	unsigned int maxSequence = 0;
+	int replayed = 0;
+
+	disk_read_blocks(journalStart(), my_super.njournalblocks, journalBuffer->data);
+	for (int i = 0; i < my_super.njournalblocks; i++) {
+		if (journalBuffer[i].journal.magic == JOURNAL_MAGIC && journalBuffer[i].journal.sequence > maxSequence) {
+			maxSequence = journalBuffer[i].journal.sequence;
+		}
+	}
+	unsigned int position = 0;
+	while (position < my_super.njournalblocks) {
+		union fs_block *header = &journalBuffer[position];
+		if (header->journal.magic != JOURNAL_MAGIC
+				|| header->journal.nblocks > my_super.njournalblocks - position - 1
+				|| (replayed > 0 && header->journal.sequence != journalBuffer[0].journal.sequence + replayed)
+				|| journalChecksum(header) != header->journal.checksum) {
+			break;
+		}
+		checkpoint(header);
+		replayed++;
+		position += 1 + header->journal.nblocks;
+	}
+	if (replayed > 0) {
+		disk_sync();
+	}
+	journalHead = 0;
+	journalSequence = maxSequence + 1;
+}
+
+/*Adds the run of count blocks from block to runs.*/
+void addRun( struct blockRuns *runs, unsigned int block, unsigned int count )
+{
+	if (runs->n == runs->capacity) {
+		runs->capacity = runs->capacity == 0 ? 16 : 2 * runs->capacity;
+		runs->blocks = (unsigned int*)realloc(runs->blocks, runs->capacity * sizeof(unsigned int));
+		runs->counts = (unsigned int*)realloc(runs->counts, runs->capacity * sizeof(unsigned int));
+	}
+	runs->blocks[runs->n] = block;
+	runs->counts[runs->n] = count;
+	runs->n++;
+}
+
+static int compareRuns( const void *a, const void *b )
+{
+	uint64_t runA = *(const uint64_t*)a;
+	uint64_t runB = *(const uint64_t*)b;
+	return (runA > runB) - (runA < runB);
+}
+
+/*Frees the blocks of the deleted files in runs, whose deletes are on stable storage, and empties it.
+The runs are sorted and the adjacent ones merged, so the host file releases each stretch of blocks
+with a single call; the blocks are dropped from the cache unwritten.*/
+void freeRuns( struct blockRuns *runs )
+{
+	uint64_t *sorted = (uint64_t*)malloc((runs->n > 0 ? runs->n : 1) * sizeof(uint64_t));
+	for (int r = 0; r < runs->n; r++) {
+		sorted[r] = (uint64_t)runs->blocks[r] << 32 | runs->counts[r];
+	}
+	qsort(sorted, runs->n, sizeof(uint64_t), compareRuns);
+	for (int r = 0; r < runs->n; ) {
+		unsigned int block = sorted[r] >> 32;
+		unsigned int count = (unsigned int)sorted[r];
+		for (r++; r < runs->n && sorted[r] >> 32 == block + count; r++) {
+			count += (unsigned int)sorted[r];
+		}
+		disk_discard(block, count);
+		for (unsigned int i = 0; i < count; i++) {
+			bitmap_clear(&blockBitMap, block + i);
+		}
+	}
+	free(sorted);
+	free(runs->blocks);
+	free(runs->counts);
+	memset(runs, 0, sizeof(*runs));
+}
+
+/*Moves the runs of freed, whose deletes are on stable storage, to discardRuns,
+and discards and frees all of them once they are a batch.*/
+void queueDiscards( struct blockRuns *freed )
+{
+	struct blockRuns batch = { NULL, NULL, 0, 0 };
+	pthread_mutex_lock(&discardLock);
+	for (int r = 0; r < freed->n; r++) {
+		addRun(&discardRuns, freed->blocks[r], freed->counts[r]);
+		discardBlocks += freed->counts[r];
+	}
+	if (discardBlocks >= discardBatch) {
+		batch = discardRuns;
+		memset(&discardRuns, 0, sizeof(discardRuns));
+		discardBlocks = 0;
+	}
+	pthread_mutex_unlock(&discardLock);
+	free(freed->blocks);
+	free(freed->counts);
+	memset(freed, 0, sizeof(*freed));
+	freeRuns(&batch);
+}
+
+/*Discards and frees the blocks in discardRuns now. Returns how many there were.*/
+unsigned int discardPending()
+{
+	pthread_mutex_lock(&discardLock);
+	struct blockRuns batch = discardRuns;
+	unsigned int count = discardBlocks;
+	memset(&discardRuns, 0, sizeof(discardRuns));
+	discardBlocks = 0;
+	pthread_mutex_unlock(&discardLock);
+	freeRuns(&batch);
+	return count;
+}
 
-struct fs_inode inode;
+/*Writes in place the latest copy of each block in the journal, whose transactions are all on disk,
+runs of consecutive blocks with a single I/O, and syncs the disk, so the journal can be reused from its start.*/
+void checkpointJournal()
+{
+	if (journalHead == 0) {
+		return;
+	}
+	int nhomes = NUM_SUPERBLOCKS + my_super.ninodeblocks;
+	for (int home = 0; home < nhomes; ) {
+		int copy = journalCopies[home];
+		if (copy < 0) {
+			home++;
+			continue;
+		}
+		int run = 1;
+		while (home + run < nhomes && journalCopies[home + run] == copy + run) {
+			run++;
+		}
+		disk_write_blocks(home, run, journalBuffer[copy].data);
+		for (int k = 0; k < run; k++) {
+			journalCopies[home + k] = -1;
+		}
+		home += run;
+	}
+	disk_sync();
+	journalHead = 0;
+}
 
 int fs_format()
+{
+  return fs_format_layout(FS_LAYOUT_BLOCKS);
+}
+
+int fs_format_layout( int layout )
 {
   union fs_block block;
+  struct bitmap map;
   unsigned int i, nblocks;
-  int ninodeblocks;
+  int ninodeblocks, njournalblocks, nbitmapblocks;
 
   if(my_super.magic == FS_MAGIC){
     printf("Cannot format a mounted disk!\n");
     return -1;
   }
+  if(layout != FS_LAYOUT_BLOCKS && layout != FS_LAYOUT_EXTENTS){
+    printf("unknown i-node layout %d\n", layout);
+    return -1;
+  }
   nblocks = disk_size();
+  bzero( block.data, DISK_BLOCK_SIZE);
   block.super.magic = FS_MAGIC;
   block.super.nblocks = nblocks;
   ninodeblocks = (int)ceil((float)nblocks*0.1);
   block.super.ninodeblocks = ninodeblocks;
   block.super.ninodes = block.super.ninodeblocks * INODES_PER_BLOCK;
+  /* 2% of the disk for the journal, enough for a transaction of the largest size */
+  njournalblocks = (int)ceil((float)nblocks*0.02);
+  if (njournalblocks < 8)
+    njournalblocks = 8;
+  if (njournalblocks > 1 + JOURNAL_MAX_BLOCKS)
+    njournalblocks = 1 + JOURNAL_MAX_BLOCKS;
+  block.super.njournalblocks = njournalblocks;
+  /* one bit per block */
+  nbitmapblocks = (nblocks + DISK_BLOCK_SIZE*8 - 1) / (DISK_BLOCK_SIZE*8);
+  block.super.nbitmapblocks = nbitmapblocks;
+  block.super.clean = TRUE;
+  block.super.journalsequence = 1;
+  block.super.initializedblocks = 0;
+  block.super.layout = layout;
+  if (NUM_SUPERBLOCKS + ninodeblocks + njournalblocks + nbitmapblocks >= nblocks) {
+    printf("disk too small!\n");
+    return -1;
+  }
 
   printf("superblock:\n");
   printf("    %d blocks\n",block.super.nblocks);
   printf("    %d inode blocks\n",block.super.ninodeblocks);
   printf("    %d inodes\n",block.super.ninodes);
+  printf("    %d journal blocks\n",block.super.njournalblocks);
+  printf("    %d bitmap blocks\n",block.super.nbitmapblocks);
+  printf("    %s\n",layout == FS_LAYOUT_EXTENTS ? "extents" : "block pointers");
 
   /* escrita do superbloco */
   disk_write(0,block.data);
 
-  /* preparacao da tabela de inodes */
-  bzero( block.data, DISK_BLOCK_SIZE);
-  for( i = 0; i < INODES_PER_BLOCK; i++ )
-    block.inode[i].isvalid = NON_VALID;
+  /* a tabela de inodes nao e' escrita: os blocos acima de initializedblocks sao tratados como vazios */
+
+  /* journal vazio */
+  disk_discard(1 + ninodeblocks, njournalblocks);
 
-  /* escrita da tabela de inodes */
-  for( i = 1; i <= ninodeblocks; i++)
-    disk_write( i, block.data );
+  /* mapa de blocos: so' os metadados estao ocupados */
+  bitmap_create(&map, nblocks);
+  for( i = 0; i < NUM_SUPERBLOCKS + ninodeblocks + njournalblocks + nbitmapblocks; i++)
+    bitmap_set(&map, i);
+  bitmap_save(&map, NUM_SUPERBLOCKS + ninodeblocks + njournalblocks, nbitmapblocks);
+  bitmap_destroy(&map);
 
   return 0;
 }
@@ -99,19 +1312,95 @@ void fs_debug()
 	printf("    %d blocks\n", sBlock.super.nblocks);
 	printf("    %d inode blocks\n", sBlock.super.ninodeblocks);
 	printf("    %d inodes\n", sBlock.super.ninodes);
+	printf("    %d journal blocks\n", sBlock.super.njournalblocks);
+	printf("    %d bitmap blocks\n", sBlock.super.nbitmapblocks);
+	printf("    %s\n", sBlock.super.layout == FS_LAYOUT_EXTENTS ? "extents" : "block pointers");
+	printf("    %s\n", sBlock.super.clean ? "clean" : "mounted or not cleanly unmounted");
+	inodeLayout = sBlock.super.layout;
 
 	for (i = 1; i <= sBlock.super.ninodeblocks; i++) {
-		disk_read(i, iBlock.data);
+		if (my_super.magic == FS_MAGIC) {
+			copyInodeBlock(i - NUM_SUPERBLOCKS, &iBlock);
+		} else if (i - NUM_SUPERBLOCKS < sBlock.super.initializedblocks) {
+			disk_read(i, iBlock.data);
+		} else {
+			break;
+		}
 		for (j = 0; j < INODES_PER_BLOCK; j++)
 			if (iBlock.inode[j].isvalid == VALID) {
 				printf("-----\n inode: %d\n", (i - 1) * INODES_PER_BLOCK + j);
-				printf("size: %d \n", iBlock.inode[j].size);
+				printf("size: %ld \n", (long)iBlock.inode[j].size);
 				printf("blocks:");
-				for (k = 0; k < POINTERS_PER_INODE; k++)
-					if (iBlock.inode[j].direct[k] != 0)
-						printf("  %d", iBlock.inode[j].direct[k]);
+				// holes inside the file are shown as '-'
+				int nFileBlocks = (iBlock.inode[j].size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+				for (k = 0; k < nFileBlocks; ) {
+					unsigned int diskBlock;
+					int run = mapRun(&iBlock.inode[j], k, nFileBlocks - k, &diskBlock);
+					for (int b = 0; b < run; b++)
+						if (diskBlock != 0)
+							printf("  %d", diskBlock + b);
+						else
+							printf("  -");
+					k += run;
+				}
 				printf("\n");
+				if (inodeLayout == FS_LAYOUT_EXTENTS) {
+					unsigned int *count;
+					union fs_block *pinned;
+					struct fs_extent *list = extentList(&iBlock.inode[j], &count, &pinned);
+					printf("extents:");
+					for (k = 0; k < *count; k++)
+						if (list[k].start != 0)
+							printf("  %d+%d", list[k].start, list[k].length);
+						else
+							printf("  -+%d", list[k].length);
+					printf("\n");
+					if (pinned != NULL) {
+						printf("extent block: %d\n", iBlock.inode[j].extentblock);
+						disk_put_block(pinned->data, FALSE);
+					}
+				} else {
+					if (iBlock.inode[j].indirect != 0)
+						printf("indirect block: %d\n", iBlock.inode[j].indirect);
+					if (iBlock.inode[j].dindirect != 0)
+						printf("double indirect block: %d\n", iBlock.inode[j].dindirect);
+				}
+			}
+	}
+}
+
+/*Reads the initialized blocks of the i-node table with a single I/O; the others are all zeros (non-valid).*/
+void readInodeTable()
+{
+	if (my_super.initializedblocks > 0) {
+		disk_read_blocks(NUM_SUPERBLOCKS, my_super.initializedblocks, inodeTable->data);
+	}
+	bzero(inodeTable[my_super.initializedblocks].data,
+		(size_t)(my_super.ninodeblocks - my_super.initializedblocks) * DISK_BLOCK_SIZE);
+}
+
+void markBlocksUsed( int block, int count )
+{
+	for (int i = 0; i < count; i++) {
+		bitmap_set(&blockBitMap, block + i);
+	}
+}
+
+/*Registers in blockBitMap the metadata blocks and the blocks of every valid i-node of the table.*/
+void scanInodeTable()
+{
+	for (int i = 0; i < firstDataBlock(); i++) {
+		bitmap_set(&blockBitMap, i);
+	}
+	for (int i = 0; i < my_super.ninodeblocks; i++) {
+		//Sweeps every inode
+		for (int j = 0; j < INODES_PER_BLOCK; j++) {
+			struct fs_inode *inode = &inodeTable[i].inode[j];
+			if (inode->isvalid) {
+				//Registers which blocks are occupied; holes have no block
+				visitFileBlocks(inode, markBlocksUsed);
 			}
+		}
 	}
 }
 
@@ -134,186 +1423,444 @@ int fs_mount()
 		return -1;
 	}
 	//mounts disk
-	my_super.magic = block.super.magic;
-	my_super.nblocks = block.super.nblocks;
-	my_super.ninodeblocks = block.super.ninodeblocks;
-	my_super.ninodes = block.super.ninodes;
-
-	blockBitMap = (unsigned char *)malloc(block.super.nblocks*sizeof(char));
+	my_super = block.super;
+	inodeLayout = my_super.layout;
 
-	// This registers the superblock and inodeblocks with NOT_FREE on the blockBitMap
+	bitmap_create(&blockBitMap, block.super.nblocks);
+	if (posix_memalign((void**)&inodeTable, DISK_BLOCK_SIZE, my_super.ninodeblocks * sizeof(union fs_block)) != 0
+			|| posix_memalign((void**)&journalBuffer, DISK_BLOCK_SIZE, my_super.njournalblocks * sizeof(union fs_block)) != 0) {
+		printf("out of memory\n");
+		abort();
+	}
+	inodeBlockDirty = (unsigned char*)calloc(my_super.ninodeblocks, sizeof(unsigned char));
+	journalCopies = (int*)malloc((NUM_SUPERBLOCKS + my_super.ninodeblocks) * sizeof(int));
 	for (int i = 0; i < NUM_SUPERBLOCKS + my_super.ninodeblocks; i++) {
-		blockBitMap[i] = NOT_FREE;
+		journalCopies[i] = -1;
+	}
+	discardBatch = min(DISCARD_BATCH, my_super.nblocks / 32 + 1);
+	delayedFiles = (struct delayedFile**)calloc(my_super.ninodes, sizeof(struct delayedFile*));
+	inodeLocks = (pthread_rwlock_t*)malloc(my_super.ninodes * sizeof(pthread_rwlock_t));
+	for (int i = 0; i < my_super.ninodes; i++) {
+		pthread_rwlock_init(&inodeLocks[i], NULL);
+	}
+	for (int handle = 0; handle < FS_MAX_OPEN_FILES; handle++) {
+		openFiles[handle].inumber = -1;
 	}
 
-	//This sweeps the inode blocks to register the various used datablocks
-	for (int i = NUM_SUPERBLOCKS; i < NUM_SUPERBLOCKS + my_super.ninodeblocks; i++) {
+	if (block.super.clean) {
+		// the bitmap saved by fs_unmount is up to date
+		journalHead = 0;
+		journalSequence = block.super.journalsequence;
+		bitmap_load(&blockBitMap, bitmapStart(), my_super.nbitmapblocks);
+		readInodeTable();
+	} else {
+		// the i-node table is only read once the journal has brought it (and the superblock) up to date,
+		// then the bitmap is rebuilt from it
+		replayJournal();
+		disk_read(0, block.data);
+		my_super.initializedblocks = block.super.initializedblocks;
+		readInodeTable();
+		scanInodeTable();
+	}
+	bitmap_create(&inodeBitMap, my_super.ninodes);
+	for (int inumber = 0; inumber < my_super.ninodes; inumber++) {
+		if (inodeRef(inumber)->isvalid) {
+			bitmap_set(&inodeBitMap, inumber);
+		}
+	}
 
-		// Reads inodeBlock
-		disk_read(i,block.data);
+	// until fs_unmount, the saved bitmap becomes out of date
+	writeSuperblock(FALSE);
+	disk_sync();
+	disk_set_flush_hook(fs_sync);
+	delayedBackground = -1;
+	disk_set_writeback_hook(writebackDelayed);
+	return 0;
+}
 
-		//Sweeps every inode
-		for (int j = 0; j < INODES_PER_BLOCK; j++) {
+int fs_unmount()
+{
+	if(my_super.magic != FS_MAGIC){
+		printf("disc not mounted\n");
+		return -1;
+	}
+	int open = 0;
+	pthread_mutex_lock(&filesLock);
+	for (int handle = 0; handle < FS_MAX_OPEN_FILES; handle++) {
+		if (openFiles[handle].inumber >= 0) {
+			open++;
+		}
+	}
+	pthread_mutex_unlock(&filesLock);
+	if (open > 0) {
+		printf("%d open files, close them first\n", open);
+		return -1;
+	}
+	disk_set_writeback_hook(NULL);
+	fs_sync();
+	// only pages that could not be mapped are left, and they would be lost
+	pthread_mutex_lock(&delayedLock);
+	int lost = delayedList != NULL;
+	for (struct delayedFile *d = delayedList; d != NULL; d = d->next) {
+		printf("file %d has %d pages that could not be written, delete it or free space\n", d->inumber, d->npages);
+	}
+	pthread_mutex_unlock(&delayedLock);
+	if (lost) {
+		disk_set_writeback_hook(writebackDelayed);
+		return -1;
+	}
+	disk_set_flush_hook(NULL);
+	checkpointJournal();
+	discardPending();
+	bitmap_save(&blockBitMap, bitmapStart(), my_super.nbitmapblocks);
+	// the bitmap has to be on disk before the superblock says it is valid
+	disk_sync();
+	writeSuperblock(TRUE);
+	disk_sync();
 
-			if(block.inode[j].isvalid) {
+	bitmap_destroy(&blockBitMap);
+	bitmap_destroy(&inodeBitMap);
+	for (int i = 0; i < my_super.ninodes; i++) {
+		pthread_rwlock_destroy(&inodeLocks[i]);
+	}
+	free(inodeLocks);
+	free(inodeBlockDirty);
+	free(delayedFiles);
+	free(inodeTable);
+	free(journalBuffer);
+	free(journalCopies);
+	inodeLocks = NULL;
+	inodeBlockDirty = NULL;
+	delayedFiles = NULL;
+	inodeTable = NULL;
+	journalBuffer = NULL;
+	journalCopies = NULL;
+	disk_counters_free(&statsCounters);
+	my_super.magic = 0;
+	return 0;
+}
 
-				//Finds the number of blocks used by inode
-				int pointToBlock = (block.inode[j].size / DISK_BLOCK_SIZE);
-				int remainder = block.inode[j].size % DISK_BLOCK_SIZE;
-				if (remainder != 0) {
-					pointToBlock++;
-				}
+/*Makes the free i-node inumber, taken from inodeBitMap, a valid empty file.*/
+void initInode( int inumber )
+{
+	pthread_rwlock_wrlock(&inodeLocks[inumber]);
+	struct fs_inode *inode = inodeRef(inumber);
+	inode->size = 0;
+	// the pointers overlap the extents, which are emptied with them
+	for (size_t i = 0; i < DIRECT_POINTERS; i++) {
+		inode->direct[i] = 0;
+	}
+	inode->indirect = 0;
+	inode->dindirect = 0;
+	__atomic_store_n(&inode->isvalid, VALID, __ATOMIC_RELEASE);
+	markInodeDirty(inumber);
+	pthread_rwlock_unlock(&inodeLocks[inumber]);
+}
 
-				//Registers which blocks are NOT_FREE
-				for (int k = 0; k < pointToBlock; k++) {
-					blockBitMap[block.inode[j].direct[k]] = NOT_FREE;
-				}
-			}
+/*Does fs_create_many.*/
+int createInodes( int count, int *inumbers )
+{
+	if(my_super.magic != FS_MAGIC){
+		printf("disc not mounted\n");
+		return -1;
+	}
+
+	// the free i-nodes are taken next to each other, so they share as few i-node blocks as possible
+	int created = 0;
+	while (created < count) {
+		int inumber = bitmap_alloc(&inodeBitMap, NULL);
+		if (inumber == -1) {
+			break;
 		}
+		initInode(inumber);
+		inumbers[created++] = inumber;
 	}
-	return 0;
+	return created;
+}
+
+int fs_create_many( int count, int *inumbers )
+{
+	long start = nowNs();
+	int created = createInodes(count, inumbers);
+	countOp(&threadStats()->create, created < count, 0, start);
+	return created;
 }
 
 int fs_create()
 {
-	if(my_super.magic != FS_MAGIC){
-		printf("disc not mounted\n");
+	int inumber;
+	if (fs_create_many(1, &inumber) != 1) {
 		return -1;
 	}
+	return inumber;
+}
 
-	union fs_block block;
+/*Returns the open file for handle, or NULL if the handle is not in use.*/
+struct fs_file *fileForHandle( int handle )
+{
+	if (my_super.magic != FS_MAGIC || handle < 0 || handle >= FS_MAX_OPEN_FILES || openFiles[handle].inumber < 0) {
+		printf("invalid file handle %d\n", handle);
+		return NULL;
+	}
+	return &openFiles[handle];
+}
 
-	//This sweeps the inode blocks to register the various used datablocks
-	for (int blockNumber = NUM_SUPERBLOCKS; blockNumber < NUM_SUPERBLOCKS + my_super.ninodeblocks; blockNumber++) {
-		disk_read(blockNumber, block.data);
-		for (int inodeIndex = 0; inodeIndex < INODES_PER_BLOCK; inodeIndex++) {
-			if(!block.inode[inodeIndex].isvalid) {
-				block.inode[inodeIndex].isvalid = VALID;
-				block.inode[inodeIndex].size = 0;
-				for (size_t i = 0; i < POINTERS_PER_INODE; i++) {
-					block.inode[inodeIndex].direct[i] = 0;
-				}
-				disk_write(blockNumber, block.data);
-				return (blockNumber - NUM_SUPERBLOCKS) * INODES_PER_BLOCK + inodeIndex;
-			}
+/*Returns TRUE if some handle has the i-node open.*/
+int isOpen( int inumber )
+{
+	int open = FALSE;
+	pthread_mutex_lock(&filesLock);
+	for (int handle = 0; handle < FS_MAX_OPEN_FILES; handle++) {
+		if (openFiles[handle].inumber == inumber) {
+			open = TRUE;
+			break;
 		}
 	}
-	return -1;
+	pthread_mutex_unlock(&filesLock);
+	return open;
 }
 
-void inode_load( int inumber, struct fs_inode *inode ){
-	int inodeBlock;
-	union fs_block block;
-
-	if( inumber > my_super.ninodes ){
-		printf("inode number too big \n");
-		abort();
+/*Marks the i-node block of a modified open file as dirty.*/
+void persistFile( struct fs_file *file )
+{
+	if (__atomic_exchange_n(&file->dirty, FALSE, __ATOMIC_ACQ_REL)) {
+		markInodeDirty(file->inumber);
 	}
-	inodeBlock = 1 + (inumber/INODES_PER_BLOCK);
-	disk_read( inodeBlock, block.data );
-	*inode = block.inode[inumber % INODES_PER_BLOCK];
 }
 
-void inode_save(int inumber, struct fs_inode* inode) {
-	int inodeBlock;
-	union fs_block block;
+/*Collects blocks of the file being deleted by the calling thread; commit frees them.*/
+void releaseBlocks( int block, int count )
+{
+	addRun(deletedRuns, block, count);
+}
 
-	if (inumber > my_super.ninodes) {
-		printf("inode number too big \n");
-		abort();
+/*Commits the modified blocks of the i-node table through the journal, in transactions of
+as many blocks as fit in it. The delayed pages get their blocks and the cached data blocks are written first, so committed i-nodes
+never point to data that is not on disk, and each transaction costs a single disk sync.
+The journal is checkpointed when a transaction does not fit in the rest of it.
+The blocks of the files deleted before the commit started are left in freed, for the caller to free
+once the commit is done: they may be freed only now that it is on disk.*/
+void commit( struct blockRuns *freed )
+{
+	int synced = FALSE;
+
+	// their i-nodes are already marked dirty, so this commit journals them
+	pthread_mutex_lock(&freedLock);
+	*freed = freedRuns;
+	memset(&freedRuns, 0, sizeof(freedRuns));
+	pthread_mutex_unlock(&freedLock);
+
+	if (allocateAllDelayed() < 0) {
+		printf("some data written to holes is not on disk yet\n");
+	}
+	disk_flush_cache();
+	pthread_mutex_lock(&filesLock);
+	for (int handle = 0; handle < FS_MAX_OPEN_FILES; handle++) {
+		if (openFiles[handle].inumber >= 0) {
+			persistFile(&openFiles[handle]);
+		}
+	}
+	pthread_mutex_unlock(&filesLock);
+
+	// Blocks past the initialized ones are written with all the blocks before them,
+	// and the superblock that moves the watermark goes in the last transaction.
+	// A block modified meanwhile past the new watermark waits for the next commit.
+	int end = my_super.initializedblocks;
+	for (int i = my_super.ninodeblocks - 1; i >= end; i--) {
+		if (__atomic_load_n(&inodeBlockDirty[i], __ATOMIC_ACQUIRE)) {
+			end = i + 1;
+			break;
+		}
+	}
+	int superblockDirty = FALSE;
+	if (end > my_super.initializedblocks) {
+		for (int i = my_super.initializedblocks; i < end; i++) {
+			__atomic_store_n(&inodeBlockDirty[i], TRUE, __ATOMIC_RELEASE);
+		}
+		my_super.initializedblocks = end;
+		superblockDirty = TRUE;
+	}
+
+	int i = 0;
+	while (TRUE) {
+		if (journalHead + 2 > my_super.njournalblocks) {
+			checkpointJournal();
+		}
+		// the transaction is built in the copy of the journal, where it is kept until the checkpoint
+		union fs_block *header = &journalBuffer[journalHead];
+		int space = my_super.njournalblocks - journalHead - 1;	// at most JOURNAL_MAX_BLOCKS, see fs_format
+		int first = i;
+		int n = 0;
+		for (; i < end && n < space; i++) {
+			// cleared before the copy, so a change made meanwhile marks the block again;
+			// read first, since most blocks are clean and the exchange is a locked instruction
+			if (__atomic_load_n(&inodeBlockDirty[i], __ATOMIC_RELAXED)
+				&& __atomic_exchange_n(&inodeBlockDirty[i], FALSE, __ATOMIC_ACQ_REL)) {
+				copyInodeBlock(i, &header[1 + n]);
+				header->journal.home[n++] = NUM_SUPERBLOCKS + i;
+			}
+		}
+		if (i == end && superblockDirty && n < space) {
+			fillSuperblock(&header[1 + n], FALSE);
+			header->journal.home[n++] = 0;
+			superblockDirty = FALSE;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (n == space && journalHead > 0 && (i < end || superblockDirty)) {
+			// the rest of the journal is too small: the blocks are taken again once it has been checkpointed
+			for (int k = 0; k < n; k++) {
+				__atomic_store_n(&inodeBlockDirty[header->journal.home[k] - NUM_SUPERBLOCKS], TRUE, __ATOMIC_RELEASE);
+			}
+			i = first;
+			checkpointJournal();
+			continue;
+		}
+		header->journal.magic = JOURNAL_MAGIC;
+		header->journal.sequence = journalSequence++;
+		header->journal.nblocks = n;
+		header->journal.checksum = journalChecksum(header);
+		disk_write_blocks(journalStart() + journalHead, 1 + n, header->data);
+		disk_sync();
+		synced = TRUE;
+		for (int k = 0; k < n; k++) {
+			journalCopies[header->journal.home[k]] = journalHead + 1 + k;
+		}
+		journalHead += 1 + n;
+	}
+	if (!synced) {
+		disk_sync();
 	}
-	inodeBlock = 1 + (inumber / INODES_PER_BLOCK);
-	disk_read(inodeBlock, block.data);
-	block.inode[inumber % INODES_PER_BLOCK] = *inode;
-	disk_write(inodeBlock, block.data);
 }
 
-int fs_delete( int inumber )
+void fs_sync()
+{
+	if (my_super.magic != FS_MAGIC) {
+		return;
+	}
+	pthread_mutex_lock(&commitLock);
+	// only a commit that starts after this call includes all the changes made before it
+	unsigned long needed = commitsStarted + 1;
+	while (commitsDone < needed) {
+		if (commitRunning) {
+			pthread_cond_wait(&commitDone, &commitLock);
+			continue;
+		}
+		commitRunning = TRUE;
+		commitsStarted++;
+		pthread_mutex_unlock(&commitLock);
+		struct blockRuns freed;
+		commit(&freed);
+		pthread_mutex_lock(&commitLock);
+		commitsDone = commitsStarted;
+		commitRunning = FALSE;
+		pthread_cond_broadcast(&commitDone);
+		// the callers served by the commit and the next commit need not wait for the host file to release the blocks
+		pthread_mutex_unlock(&commitLock);
+		queueDiscards(&freed);
+		pthread_mutex_lock(&commitLock);
+	}
+	pthread_mutex_unlock(&commitLock);
+}
+
+/*Does fs_delete.*/
+int deleteInode( int inumber )
 {
 	if(my_super.magic != FS_MAGIC){
 		printf("disc not mounted\n");
 		return -1;
 	}
 	// CHECKS IF THE INODE NUMBER IS LOWER THAN THE TOTAL NUMBER OF INODES
-	if (my_super.ninodes < inumber) {
+	if (inumber < 0 || inumber >= my_super.ninodes) {
 		return -1;
 	}
 
-	inode_load(inumber, &inode);
-	if (inode.isvalid == NON_VALID) {
+	pthread_rwlock_wrlock(&inodeLocks[inumber]);
+	struct fs_inode *inode = inodeRef(inumber);
+	if (inode->isvalid == NON_VALID) {
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
 		return -1;
 	}
-
-	//Number of blocks occupied of the file
-	int numBlocks = (int)ceil((float)inode.size/DISK_BLOCK_SIZE);
-
-	//Updating BitMap
-	for (int i = 0; i < numBlocks; i++) {
-		blockBitMap[inode.direct[i]] = FREE;
+	if (isOpen(inumber)) {
+		printf("file is open\n");
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
+		return -1;
 	}
 
-	inode.isvalid = NON_VALID;
-	inode_save(inumber, &inode);
+	// delayed pages never got blocks
+	if (delayedFiles[inumber] != NULL) {
+		dropDelayedPages(inumber, delayedFiles[inumber]->npages);
+	}
+	// the blocks are handed to the commit together with the i-node change, so any commit that takes them
+	// also journals the delete; holes have no block
+	struct blockRuns runs = { NULL, NULL, 0, 0 };
+	deletedRuns = &runs;
+	visitFileBlocks(inode, releaseBlocks);
+	deletedRuns = NULL;
+	pthread_mutex_lock(&freedLock);
+	__atomic_store_n(&inode->isvalid, NON_VALID, __ATOMIC_RELEASE);
+	markInodeDirty(inumber);
+	for (int r = 0; r < runs.n; r++) {
+		addRun(&freedRuns, runs.blocks[r], runs.counts[r]);
+	}
+	pthread_mutex_unlock(&freedLock);
+	free(runs.blocks);
+	free(runs.counts);
+	bitmap_clear(&inodeBitMap, inumber);
+	pthread_rwlock_unlock(&inodeLocks[inumber]);
 
 	return 0;
 }
 
-int fs_getsize( int inumber )
+int fs_delete( int inumber )
+{
+	long start = nowNs();
+	int result = deleteInode(inumber);
+	countOp(&threadStats()->delete, result < 0, 0, start);
+	return result;
+}
+
+long fs_getsize( int inumber )
 {
 	if(my_super.magic != FS_MAGIC){
 		printf("disc not mounted\n");
 		return -1;
 	}
 	// CHECKS IF THE INODE NUMBER IS LOWER THAN THE TOTAL NUMBER OF INODES
-	if (my_super.ninodes < inumber) {
+	if (inumber < 0 || inumber >= my_super.ninodes) {
 		return -1;
 	}
-	inode_load(inumber, &inode);
-	return inode.size;
+	pthread_rwlock_rdlock(&inodeLocks[inumber]);
+	long size = inodeRef(inumber)->size;
+	pthread_rwlock_unlock(&inodeLocks[inumber]);
+	return size;
 }
 
 
 /**************************************************************/
-int min(int a, int b) {
-	if (a < b) {
-		return a;
-	} else {
-		return b;
-	}
-}
 
-/*Writes dataLimit of data starting at dataOffset in data
-up to (bufferLimit - bufferOffset) in buffer starting at bufferOffset
-Returns the number of bytes written*/
-int writeDataInBuffer(char* buffer, int bufferOffset, int bufferLimit, char* data, int dataOffset, int dataLimit) {
-	int limit = min(bufferLimit, dataLimit);
-	for (int i = 0; i < limit; i++) {
-		buffer[i + bufferOffset] = data[i + dataOffset];
-	}
-	return limit;
-}
-
-int fs_read( int inumber, char *data, int length, int offset )
+/*Reads from the file inumber, described by inode, through the handle file if not NULL; see fs_read.*/
+long readInode( int inumber, struct fs_inode *inode, struct fs_file *file, char *data, long length, long offset )
 {
-	int currentBlock, offsetCurrent, offsetInBlock;
-	int bytesLeft, nCopy, bytesToRead;
+	int currentBlock, offsetInBlock;
+	long size, offsetCurrent, bytesLeft, nCopy, bytesToRead;
 	char *dst;
-	union fs_block buff;
 
-	if(my_super.magic != FS_MAGIC){
-		printf("disc not mounted\n");
+	if( inode->isvalid == NON_VALID ){
+		printf("inode is not valid\n");
 		return -1;
 	}
-	inode_load( inumber, &inode );
-	if( inode.isvalid == NON_VALID ){
-		printf("inode is not valid\n");
+	if (offset < 0 || length < 0) {
+		printf("negative offset or length\n");
 		return -1;
 	}
-	if( offset > inode.size ){
+	size = inode->size;
+	if( offset > size ){
 		printf("offset bigger that file size !\n");
 		return -1;
 	}
-	if (inode.size == 0) {
+	if (size == 0) {
 		return 0;
 	}
 
@@ -326,9 +1873,38 @@ int fs_read( int inumber, char *data, int length, int offset )
 	offsetCurrent = offset;
 
 	// Start, Mid and End
-	while (inode.size - offsetCurrent > 0 && bytesLeft > 0) {
-		disk_read_data(inode.direct[currentBlock++], buff.data);
-		nCopy = writeDataInBuffer(dst, bytesToRead, min(bytesLeft, inode.size - offsetCurrent), buff.data, offsetInBlock, DISK_BLOCK_SIZE - offsetInBlock);
+	while (size - offsetCurrent > 0 && bytesLeft > 0) {
+		int wholeBlocks = min(bytesLeft, size - offsetCurrent) / DISK_BLOCK_SIZE;
+		unsigned int diskBlock;
+		int run = mapFileRun(file, inode, currentBlock, wholeBlocks > 0 ? wholeBlocks : 1, &diskBlock);
+		if (diskBlock == 0) {
+			// Hole: reads as zeros, without any I/O, unless it has delayed pages
+			nCopy = min(min(bytesLeft, size - offsetCurrent), (long)run * DISK_BLOCK_SIZE - offsetInBlock);
+			for (long copied = 0; copied < nCopy; ) {
+				char *page = delayedPage(inumber, currentBlock + (offsetInBlock + copied) / DISK_BLOCK_SIZE);
+				int offsetInPage = (offsetInBlock + copied) % DISK_BLOCK_SIZE;
+				int n = min(nCopy - copied, DISK_BLOCK_SIZE - offsetInPage);
+				if (page != NULL) {
+					memcpy(dst + bytesToRead + copied, page + offsetInPage, n);
+				} else {
+					bzero(dst + bytesToRead + copied, n);
+				}
+				copied += n;
+			}
+			currentBlock += (offsetInBlock + nCopy) / DISK_BLOCK_SIZE;
+		} else if (offsetInBlock == 0 && wholeBlocks > 0) {
+			// Mid: whole blocks that are contiguous on disk are read straight into data
+			disk_read_range(diskBlock, run, dst + bytesToRead);
+			currentBlock += run;
+			nCopy = (long)run * DISK_BLOCK_SIZE;
+		} else {
+			// Start and End: part of a block is copied straight from the cache
+			char *block = disk_get_block(diskBlock, DISK_GET_READ);
+			currentBlock++;
+			nCopy = min(min(bytesLeft, size - offsetCurrent), DISK_BLOCK_SIZE - offsetInBlock);
+			memcpy(dst + bytesToRead, block + offsetInBlock, nCopy);
+			disk_put_block(block, FALSE);
+		}
 		bytesToRead += nCopy;
 		bytesLeft -= nCopy;
 		offsetCurrent += nCopy;
@@ -337,43 +1913,42 @@ int fs_read( int inumber, char *data, int length, int offset )
 	return bytesToRead;
 }
 
-/******************************************************************/
-int getFreeBlock(){
-	int i, found;
-
-	i = 0;
-	found = FALSE;
-	do{
-		if(blockBitMap[i] == FREE){
-			found = TRUE;
-			blockBitMap[i] = NOT_FREE;
-		}
-		else i++;
-	}while((!found) && (i < my_super.nblocks));
-
-	if(i == my_super.nblocks) return -1; /* nao ha' blocos livres */
-	else return i;
+long fs_read( int inumber, char *data, long length, long offset )
+{
+	long start = nowNs();
+	long bytesRead = -1;
+	if(my_super.magic != FS_MAGIC){
+		printf("disc not mounted\n");
+	} else if (inumber >= 0 && inumber < my_super.ninodes) {
+		pthread_rwlock_rdlock(&inodeLocks[inumber]);
+		bytesRead = readInode( inumber, inodeRef(inumber), NULL, data, length, offset );
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
+	}
+	countOp(&threadStats()->read, bytesRead < 0, bytesRead > 0 ? bytesRead : 0, start);
+	return bytesRead;
 }
 
-int fs_write( int inumber, char *data, int length, int offset )
+/******************************************************************/
+
+/*Writes into the file inumber, described by inode, through the handle file if not NULL; see fs_write. Data written to holes goes to
+delayed pages, which get their blocks when the file system is synced, or here if there are too many.
+The caller is responsible for saving the inode.*/
+long writeInode( int inumber, struct fs_inode *inode, struct fs_file *file, char *data, long length, long offset )
 {
 	int currentBlock, offsetInBlock;
-	int bytesLeft, nCopy, bytesToWrite, newEntry;
-	int originalNBlocks, originalSize;
+	long bytesLeft, nCopy, bytesToWrite;
 	char *src;
-	union fs_block buff;
 
-	if(my_super.magic != FS_MAGIC){
-		printf("disc not mounted\n");
+	if( inode->isvalid == NON_VALID ){
+		printf("inode is not valid\n");
 		return -1;
 	}
-	inode_load( inumber, &inode );
-	if( inode.isvalid == NON_VALID ){
-		printf("inode is not valid\n");
+	if (offset < 0 || length < 0) {
+		printf("negative offset or length\n");
 		return -1;
 	}
-	if( offset > inode.size ){
-		printf("starting to write after end of file\n");
+	if (offset > MAX_FILE_SIZE) {
+		printf("offset bigger than the maximum file size\n");
 		return -1;
 	}
 
@@ -383,44 +1958,234 @@ int fs_write( int inumber, char *data, int length, int offset )
 	currentBlock = offset / DISK_BLOCK_SIZE;
 	offsetInBlock = offset % DISK_BLOCK_SIZE;
 	src = data;
-	originalSize = inode.size;
-
-	originalNBlocks = (inode.size / DISK_BLOCK_SIZE) - 1;
-	if (inode.size % DISK_BLOCK_SIZE > 0) {
-		originalNBlocks++;
-	}
 
 	// Start, Mid and End
-	while (bytesLeft > 0 && currentBlock < POINTERS_PER_INODE) {
-		if (currentBlock > originalNBlocks) {
-			newEntry = getFreeBlock();
-			if (newEntry == -1) {
-				if (inode.size < originalSize) {
-					inode.size = originalSize;
-				}
-				inode_save(inumber, &inode);
-				return bytesToWrite;
+	while (bytesLeft > 0 && currentBlock < MAX_FILE_BLOCKS) {
+		unsigned int diskBlock;
+		int wholeBlocks = min(bytesLeft / DISK_BLOCK_SIZE, MAX_FILE_BLOCKS - currentBlock);
+		int run = mapFileRun(file, inode, currentBlock, offsetInBlock == 0 && wholeBlocks > 0 ? wholeBlocks : 1, &diskBlock);
+		if (diskBlock == 0) {
+			// Hole (possibly past the end of the file): its pages start as zeros
+			char *page = addDelayedPage(inumber, currentBlock);
+			if (page == NULL && discardPending() > 0) {
+				// the blocks of the deleted files may be enough
+				page = addDelayedPage(inumber, currentBlock);
 			}
-			inode.direct[currentBlock] = newEntry;
+			if (page == NULL) {
+				break;
+			}
+			nCopy = min(bytesLeft, DISK_BLOCK_SIZE - offsetInBlock);
+			memcpy(page + offsetInBlock, src + bytesToWrite, nCopy);
+			currentBlock++;
+		} else if (offsetInBlock == 0 && wholeBlocks > 0) {
+			// Mid: whole blocks that are contiguous on disk are overwritten without being read, with a single write
+			disk_write_range(diskBlock, run, src + bytesToWrite);
+			currentBlock += run;
+			nCopy = (long)run * DISK_BLOCK_SIZE;
 		} else {
-			disk_read_data(inode.direct[currentBlock], buff.data);
-		}
-		nCopy = writeDataInBuffer(buff.data, offsetInBlock, DISK_BLOCK_SIZE - offsetInBlock, src, bytesToWrite, bytesLeft);
-		disk_write_data(inode.direct[currentBlock++], buff.data);
-		if (currentBlock - 1 == originalNBlocks && originalNBlocks != 13) {
-			inode.size -= (inode.size % DISK_BLOCK_SIZE) - offsetInBlock;
+			// Start and End: part of a block is modified in place in the cache
+			char *block = disk_get_block(diskBlock, DISK_GET_READ);
+			nCopy = min(bytesLeft, DISK_BLOCK_SIZE - offsetInBlock);
+			memcpy(block + offsetInBlock, src + bytesToWrite, nCopy);
+			disk_put_block(block, TRUE);
+			currentBlock++;
 		}
-		if (currentBlock - 1 < originalNBlocks || (currentBlock - 1 == originalNBlocks && originalNBlocks == 13)) {
-			inode.size -= DISK_BLOCK_SIZE - offsetInBlock;
-		}
-		inode.size += nCopy;
 		bytesToWrite += nCopy;
 		bytesLeft -= nCopy;
 		offsetInBlock = 0;
 	}
-	if (inode.size < originalSize) {
-		inode.size = originalSize;
+	if (offset + bytesToWrite > (long)inode->size) {
+		inode->size = offset + bytesToWrite;
+	}
+	if (__atomic_load_n(&delayedPages, __ATOMIC_RELAXED) > DELAYED_LIMIT) {
+		allocateDelayed(inumber);
 	}
-	inode_save( inumber, &inode );
 	return bytesToWrite;
 }
+
+long fs_write( int inumber, char *data, long length, long offset )
+{
+	long start = nowNs();
+	long bytesWritten = -1;
+
+	if(my_super.magic != FS_MAGIC){
+		printf("disc not mounted\n");
+	} else if (inumber >= 0 && inumber < my_super.ninodes) {
+		pthread_rwlock_wrlock(&inodeLocks[inumber]);
+		bytesWritten = writeInode( inumber, inodeRef(inumber), NULL, data, length, offset );
+		if (bytesWritten >= 0) {
+			markInodeDirty( inumber );
+		}
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
+		wakeWriteback();
+	}
+	countOp(&threadStats()->write, bytesWritten < 0, bytesWritten > 0 ? bytesWritten : 0, start);
+	return bytesWritten;
+}
+
+/******************************************************************/
+/* Open files */
+
+int fs_open( int inumber )
+{
+	if(my_super.magic != FS_MAGIC){
+		printf("disc not mounted\n");
+		return -1;
+	}
+	if (inumber < 0 || inumber >= my_super.ninodes) {
+		return -1;
+	}
+	// the i-node is locked so that it cannot be deleted before the handle is registered
+	pthread_rwlock_rdlock(&inodeLocks[inumber]);
+	struct fs_inode *pinned = inodeRef(inumber);
+	if (pinned->isvalid == NON_VALID) {
+		printf("inode is not valid\n");
+		pthread_rwlock_unlock(&inodeLocks[inumber]);
+		return -1;
+	}
+	pthread_mutex_lock(&filesLock);
+	for (int handle = 0; handle < FS_MAX_OPEN_FILES; handle++) {
+		if (openFiles[handle].inumber < 0) {
+			openFiles[handle].inumber = inumber;
+			openFiles[handle].inode = pinned;
+			openFiles[handle].dirty = FALSE;
+			openFiles[handle].current = 0;
+			pthread_mutex_unlock(&filesLock);
+			pthread_rwlock_unlock(&inodeLocks[inumber]);
+			return handle;
+		}
+	}
+	pthread_mutex_unlock(&filesLock);
+	pthread_rwlock_unlock(&inodeLocks[inumber]);
+	printf("too many open files\n");
+	return -1;
+}
+
+long fs_pread( int handle, char *data, long length, long offset )
+{
+	long start = nowNs();
+	long bytesRead = -1;
+	struct fs_file *file = fileForHandle(handle);
+	if (file != NULL) {
+		pthread_rwlock_rdlock(&inodeLocks[file->inumber]);
+		bytesRead = readInode( file->inumber, file->inode, file, data, length, offset );
+		pthread_rwlock_unlock(&inodeLocks[file->inumber]);
+	}
+	countOp(&threadStats()->read, bytesRead < 0, bytesRead > 0 ? bytesRead : 0, start);
+	return bytesRead;
+}
+
+long fs_pwrite( int handle, char *data, long length, long offset )
+{
+	long start = nowNs();
+	long bytesWritten = -1;
+	struct fs_file *file = fileForHandle(handle);
+	if (file != NULL) {
+		pthread_rwlock_wrlock(&inodeLocks[file->inumber]);
+		bytesWritten = writeInode( file->inumber, file->inode, file, data, length, offset );
+		if (bytesWritten > 0) {
+			__atomic_store_n(&file->dirty, TRUE, __ATOMIC_RELEASE);
+		}
+		pthread_rwlock_unlock(&inodeLocks[file->inumber]);
+		wakeWriteback();
+	}
+	countOp(&threadStats()->write, bytesWritten < 0, bytesWritten > 0 ? bytesWritten : 0, start);
+	return bytesWritten;
+}
+
+int fs_close( int handle )
+{
+	struct fs_file *file = fileForHandle(handle);
+	if (file == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&filesLock);
+	persistFile(file);
+	file->inumber = -1;
+	file->inode = NULL;
+	pthread_mutex_unlock(&filesLock);
+	return 0;
+}
+
+// Completed asynchronous requests without callback, until fs_reap takes them
+static pthread_mutex_t requestsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requestCompleted = PTHREAD_COND_INITIALIZER;
+static struct fs_request *doneFirst, *doneLast;
+static int unreaped = 0;	// requests without callback submitted and not reaped yet
+
+// Runs in a worker thread of the disk: carries out the request
+static void runRequest( struct disk_request *io )
+{
+	struct fs_request *request = (struct fs_request*)io->context;
+	if (request->handle < 0) {
+		request->result = request->write
+			? fs_write( request->inumber, request->data, request->length, request->offset )
+			: fs_read( request->inumber, request->data, request->length, request->offset );
+	} else {
+		request->result = request->write
+			? fs_pwrite( request->handle, request->data, request->length, request->offset )
+			: fs_pread( request->handle, request->data, request->length, request->offset );
+	}
+}
+
+// Completion of the disk request: calls the callback or queues the request for fs_reap
+static void completeRequest( struct disk_request *io )
+{
+	struct fs_request *request = (struct fs_request*)io->context;
+	if (request->callback != NULL) {
+		request->callback( request );
+		return;
+	}
+	pthread_mutex_lock(&requestsLock);
+	request->next = NULL;
+	if (doneLast != NULL) {
+		doneLast->next = request;
+	} else {
+		doneFirst = request;
+	}
+	doneLast = request;
+	pthread_cond_broadcast(&requestCompleted);
+	pthread_mutex_unlock(&requestsLock);
+}
+
+static void submitRequest( struct fs_request *request, int write )
+{
+	request->write = write;
+	if (request->callback == NULL) {
+		pthread_mutex_lock(&requestsLock);
+		unreaped++;
+		pthread_mutex_unlock(&requestsLock);
+	}
+	request->io.callback = completeRequest;
+	request->io.context = request;
+	disk_submit_call( &request->io, runRequest );
+}
+
+void fs_read_async( struct fs_request *request )
+{
+	submitRequest( request, FALSE );
+}
+
+void fs_write_async( struct fs_request *request )
+{
+	submitRequest( request, TRUE );
+}
+
+struct fs_request *fs_reap( int wait )
+{
+	pthread_mutex_lock(&requestsLock);
+	while (doneFirst == NULL && wait && unreaped > 0) {
+		pthread_cond_wait(&requestCompleted, &requestsLock);
+	}
+	struct fs_request *request = doneFirst;
+	if (request != NULL) {
+		doneFirst = request->next;
+		if (doneFirst == NULL) {
+			doneLast = NULL;
+		}
+		unreaped--;
+	}
+	pthread_mutex_unlock(&requestsLock);
+	return request;
+}
+
@@ -1,54 +1,189 @@
 #ifndef FS_H
 #define FS_H
 
+#include "disk.h"
+
+/*#Once the disk is mounted, the file operations (fs_create, fs_create_many, fs_delete, fs_getsize,
+fs_read, fs_write, fs_open, fs_pread, fs_pwrite, fs_close and fs_sync) may be called from several threads at the same time:
+reads of a file run in parallel, writes and deletes of a file exclude the other operations on it.
+fs_format, fs_mount, fs_unmount and fs_debug must not run concurrently with other calls.*/
+
 /*#Prints detailed information about the file system.
 Reports the contents of the i-node table.*/
 void fs_debug();
 
 /*#Formats the disk.
 Creates a new file system (FS) in the disk, destroying all the disk's content.
-Reserves 10% of the blocks for the i-node table; this table is initialized with all the i-nodes (non-valid).
+Reserves 10% of the blocks for the i-node table; this table starts with all the i-nodes non-valid.
+The table is initialized lazily: the superblock records how many of its blocks have been written,
+and the rest are treated as empty, so formatting takes the same time whatever the size of the disk.
+Reserves 2% of the blocks (at least 8) for the journal of the i-node table, right after it,
+followed by the blocks of the bitmap of free/occupied blocks.
 Please note that formatting a disk does not imply that the disk is accessible.
 This is performed by the mount operation.
 Trying to format a mounted disk is not allowed; invoking fs_format with the disk in use should do nothing and return an error.*/
 int  fs_format();
 
+/*#How i-nodes map the blocks of files, chosen when the disk is formatted.
+FS_LAYOUT_BLOCKS: a pointer per block, through direct, indirect and double indirect pointers.
+FS_LAYOUT_EXTENTS: runs of consecutive blocks (extents), 5 in the i-node and up to 511 in an extent block;
+a file written in order takes a single extent, and transfers of it are done in a few large I/Os.*/
+#define FS_LAYOUT_BLOCKS  0
+#define FS_LAYOUT_EXTENTS 1
+
+/*#Same as fs_format, with the i-nodes of the new FS mapping their blocks as layout says.
+fs_format uses FS_LAYOUT_BLOCKS.*/
+int  fs_format_layout( int layout );
+
 /*#Mounts the filesystem (reads the superblock and the i-node table; builds the block map).
 Verifies if there is a valid FS in the disk.
 If the FS in the disk is valid, this operation reads the superblock and, using the i-node table in disk, builds in RAM the map of free/occupied blocks.
+If the disk was unmounted with fs_unmount, the map is loaded from the bitmap blocks instead.
+Otherwise the transactions in the journal are replayed first, completing the last commits,
+and the map is rebuilt by scanning the i-node table.
 Please note that all the following operations should fail if the disk is not mounted.*/
 int  fs_mount();
 
+/*#Unmounts the filesystem: commits the changes, writes the journal in place, frees the blocks of the deleted files, saves the map of free/occupied blocks and marks the disk as clean,
+so that the next mount does not have to rebuild the map. Must be called before disk_close.
+Returns 0 if success; -1 if the disk is not mounted, if some file is open (see fs_open), or if data written to holes
+could not get disk blocks; in the last two cases the disk stays mounted.*/
+int  fs_unmount();
+
 /*#Creates a new file; returns the i-node number.
-Marks the first free i-node as occupied by a file of length 0.
+Marks a free i-node as occupied by a file of length 0; the free i-nodes are kept in an index built by fs_mount,
+so the i-node table is not scanned.
 Returns the number of the allocated i-node. In error, returns -1*/
 int  fs_create();
 
+/*#Creates up to count files, storing their i-node numbers in inumbers.
+The i-nodes are taken next to each other, so they share as few i-node blocks as possible.
+Returns the number of files created, lower than count if the i-nodes run out; -1 if the disk is not mounted.*/
+int  fs_create_many( int count, int *inumbers );
+
 /*#Deletes the file with inode inumber.
 Removes the file with i-node inumber.
 Frees the i-node entry and declares all the blocks associated with it as free by updating the map of free/occupied blocks.
+The blocks may only be reused once the delete is on disk, after the next fs_sync: they are then freed
+and discarded (see disk_discard), so the disk image releases their storage, in batches together with
+the blocks of other deletes, or as soon as a write runs out of free blocks, and at the latest by fs_unmount.
 Returns 0 if success; -1 if an error occurs.*/
 int  fs_delete( int inumber );
 
 /*#Returns the size of the file inumber.
 Returns the length of the file associated with the i-node.
 In error, returns -1.*/
-int  fs_getsize(int inumber);
+long fs_getsize(int inumber);
 
 /*#Reads length bytes, starting at offset, from file inode, and transfers the bytes to a buffer that starts on address data.
 Transfers data from a file (identified by a valid i-node) to memory.
 Copies length bytes from the i-node inode to the address data pointer, starting at offset in the file.
 Returns the effective number of bytes read.
 This number of bytes read can be lower than the number of bytes requested if the distance from offset to the end of the file is less than length.
-In case of error, returns -1.*/
-int  fs_read( int inumber, char *data, int length, int offset );
+Holes in the file read as zeros, without any disk I/O.
+In case of error, such as a negative offset or length or an offset past the end of the file, returns -1.*/
+long fs_read( int inumber, char *data, long length, long offset );
 
 /*#Writes length bytes, starting at offset, into file inode by transferring the bytes from a buffer that starts in data.
 Transfers data between memory and the file designated by inode.
 Copies length bytes from the address data to the file starting at position defined in offset.
-This operation will allocate the necessary disk blocks.
-Returns the number of bytes really written to the file; this number of written bytes can be lower than the length, in case there are no free disk blocks.
-In case of other errors, returns -1.*/
-int  fs_write( int inumber, char *data, int length, int offset );
+This operation will allocate the necessary disk blocks. Their allocation is delayed: data written where the file
+has no blocks is kept in memory, with a block reserved for it, until fs_sync (or disk_flush), until the disk's
+background flusher writes back blocks dirty for as long, or until there is too much of it;
+then each file gets contiguous blocks for all of it at once. A file deleted before that
+never takes blocks or writes its data.
+The offset may be past the end of the file: the blocks between the end and offset are left as holes,
+which take no disk space and read as zeros, and only the blocks the write touches are allocated.
+With FS_LAYOUT_BLOCKS, a file has 11 direct blocks, 1024 more through its indirect block and 1024*1024 through its double indirect one;
+files of either layout can grow to that many blocks, a little over 4 GiB.
+With FS_LAYOUT_EXTENTS, a new block is taken right after the previous one of the file when it is free, and the write
+stops if the file would need more than 511 extents.
+Returns the number of bytes really written to the file; this number of written bytes can be lower than the length, in case there are no free disk blocks to reserve.
+In case of other errors, such as a negative offset or length or an offset past the maximum size of a file, returns -1.*/
+long fs_write( int inumber, char *data, long length, long offset );
+
+/*#Maximum number of files open at the same time.*/
+#define FS_MAX_OPEN_FILES 64
+
+/*#Opens the file with i-node inumber.
+The i-node stays pinned in memory until fs_close, so fs_pread/fs_pwrite do not have to look it up or save it on every call.
+Returns a handle for the other calls; -1 on error.*/
+int  fs_open( int inumber );
+
+/*#Same as fs_read, on the file open with handle.*/
+long fs_pread( int handle, char *data, long length, long offset );
+
+/*#Same as fs_write, on the file open with handle.
+The changes to the i-node are persisted by fs_close or fs_sync.*/
+long fs_pwrite( int handle, char *data, long length, long offset );
+
+/*#Closes the handle, persisting the changes to the i-node of the file.
+Returns 0 if success; -1 if the handle is not open.*/
+int  fs_close( int handle );
+
+/*#Writes the modified i-nodes, kept in memory while the disk is mounted, back to disk.
+Makes all the operations completed before the call durable: the delayed blocks are allocated, the cached data blocks are written,
+then the i-node changes are committed through the journal with a single disk sync.
+Calls made from several threads while a commit runs share the next commit (group commit).
+It is also invoked by disk_flush.*/
+void fs_sync();
+
+/*#Asynchronous file request. fs_read_async/fs_write_async queue it and return at once; a worker thread
+of the disk's pool carries it out as fs_read/fs_write (handle -1) or fs_pread/fs_pwrite (an open handle),
+and stores what that call returns in result.
+Then callback is called in the worker thread, or, without callback, the request is queued for fs_reap.
+Requests run in no particular order, even on the same file: a writer that extends a file should wait
+for a write to complete before submitting the next one.
+The request and its data must stay valid until it completes.*/
+struct fs_request {
+	int inumber;	// file, when handle is -1
+	int handle;	// open file, or -1
+	char *data;
+	long length;
+	long offset;
+	long result;	// bytes transferred, or -1
+	void (*callback)( struct fs_request *request );	// NULL to use fs_reap
+	void *context;	// free for the submitter
+	// private
+	int write;
+	struct disk_request io;
+	struct fs_request *next;
+};
+
+void fs_read_async( struct fs_request *request );
+void fs_write_async( struct fs_request *request );
+
+/*#Returns a completed request that had no callback. If there is none yet and wait is 1,
+waits for one, unless no such request is in flight. Returns NULL if there is none.*/
+struct fs_request *fs_reap( int wait );
+
+/*#Buckets of the histograms of fs_stats, by log2 of the value as with disk_stats_bucket.*/
+#define FS_STATS_BUCKETS 32
+
+/*#Calls of one file operation.*/
+struct fs_op_stats {
+	long count;
+	long errors;	// calls that returned -1; for fs_create_many, that created fewer files than asked
+	long bytes;	// transferred, for fs_read and fs_write (fs_pread and fs_pwrite included)
+	long latency[FS_STATS_BUCKETS];	// calls by duration in nanoseconds
+};
+
+/*#Activity of the mounted file system since fs_mount or fs_stats_reset, added up over all the threads.
+fs_read and fs_write count fs_pread and fs_pwrite as well, and create counts calls of fs_create_many.*/
+struct fs_stats {
+	struct fs_op_stats read;
+	struct fs_op_stats write;
+	struct fs_op_stats create;
+	struct fs_op_stats delete;
+	long allocations;	// free blocks searched for in the map of free/occupied blocks
+	long alloc_words;	// 64-bit words of the map those searches went through
+	long alloc_scan[FS_STATS_BUCKETS];	// searches by number of words
+};
+
+/*#Fills stats with the activity of the file system so far; it may be called while other threads use it.*/
+void fs_stats( struct fs_stats *stats );
+
+/*#Starts counting the activity of the file system from zero again.*/
+void fs_stats_reset();
 
 #endif
@@ -8,7 +8,8 @@
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
-static int do_insert( const char *filename, int inumber, int at_offset );
+static int do_insert( const char *filename, int inumber, long at_offset );
+static void do_stats( int json );
 
 int main( int argc, char *argv[] )
 {
@@ -17,14 +18,26 @@ int main( int argc, char *argv[] )
 	char arg1[1024];
 	char arg2[1024];
 	char arg3[1024];
-	int inumber, result, args;
+	int inumber, args;
+	long result;
+	int mounted = 0;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	struct disk_config config;
+
+	if(argc<3) {
+		printf("use: %s <diskfile> <nblocks> [option=value ...]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	disk_config_default(&config);
+	for(int i=3;i<argc;i++) {
+		if(disk_config_set(&config,argv[i])<0) {
+			printf("invalid disk option: %s\n",argv[i]);
+			return 1;
+		}
+	}
+
+	if(!disk_init_config(argv[1],atoi(argv[2]),&config)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
@@ -45,18 +58,19 @@ int main( int argc, char *argv[] )
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(!fs_format()) {
+			if(args==1 || (args==2 && !strcmp(arg1,"extents"))) {
+				if(!fs_format_layout(args==2 ? FS_LAYOUT_EXTENTS : FS_LAYOUT_BLOCKS)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extents]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
 				if(!fs_mount()) {
+					mounted = 1;
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -64,6 +78,17 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(!fs_unmount()) {
+					mounted = 0;
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
@@ -81,7 +106,7 @@ int main( int argc, char *argv[] )
 				inumber = atoi(arg1);
 				result = fs_getsize(inumber);
 				if( result >= 0 )	{
-					printf("inode %d has size %d\n",inumber,result);
+					printf("inode %d has size %ld\n",inumber,result);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -136,7 +161,7 @@ int main( int argc, char *argv[] )
 		else if(!strcmp(cmd,"insertinfile")) {
 			if(args==4) {
 				inumber = atoi(arg2);
-				if(do_insert(arg1, inumber, atoi(arg3))>0) {
+				if(do_insert(arg1, inumber, atol(arg3))>0) {
 					printf("inserted file %s to inode %d in position %s\n",arg1,inumber,arg3);
 				} else {
 					printf("insert failed!\n");
@@ -156,6 +181,18 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: copyout <inumber> <filename>\n");
 			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				do_stats(0);
+			} else if(args==2 && !strcmp(arg1,"json")) {
+				do_stats(1);
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				disk_stats_reset();
+				fs_stats_reset();
+				printf("statistics reset.\n");
+			} else {
+				printf("use: stats [reset|json]\n");
+			}
 		} else if(!strcmp(cmd,"diskflush")) {
 			if(args==1) {
 				disk_flush();
@@ -164,8 +201,9 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [extents]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
 			printf("    cachedebug\n" );
 			printf("    create\n");
@@ -174,6 +212,7 @@ int main( int argc, char *argv[] )
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
 			printf("    insertinfile <file> <inode> <offset>\n");
+			printf("    stats   [reset|json]\n");
 			printf("    diskflush\n");
 			printf("    help\n");
 			printf("    quit\n");
@@ -189,6 +228,9 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	if(mounted) {
+		fs_unmount();
+	}
 	printf("closing emulated disk.\n");
 	disk_close();
 
@@ -198,9 +240,10 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	//char buffer[16384];
-	char buffer[100];
+	long offset=0, actual;
+	int result, handle, current=0;
+	static char buffers[2][16384];
+	struct fs_request request, *pending=NULL;
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -208,62 +251,86 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	handle = fs_open(inumber);
+	if(handle<0) {
+		fclose(file);
+		return 0;
+	}
+
+	// while a buffer is being written to the file, the next one is read from the host file
 	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+		result = fread(buffers[current],1,sizeof(buffers[current]),file);
+		if(pending) {
+			pending = fs_reap(1);
+			actual = pending->result;
+			pending = NULL;
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_pwrite return invalid result %ld\n",actual);
 				break;
 			}
 			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+			if(actual!=request.length) {
+				printf("WARNING: fs_pwrite only wrote %ld bytes, not %ld bytes\n",actual,request.length);
 				break;
 			}
 		}
+		if(result<=0) break;
+		request.handle = handle;
+		request.data = buffers[current];
+		request.length = result;
+		request.offset = offset;
+		request.callback = NULL;
+		fs_write_async(&request);
+		pending = &request;
+		current = 1-current;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%ld bytes copied\n",offset);
 
+	fs_close(handle);
 	fclose(file);
 	return 1;
 }
 
-
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
-	//char buffer[16384];
-	char buffer[100];
+	long offset=0, result;
+	int handle;
+	char buffer[16384];
+
+	handle = fs_open(inumber);
+	if(handle<0) {
+		return -1;
+	}
 
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(handle);
 		return 0;
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_pread(handle,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%ld bytes copied\n",offset);
 
 	fclose(file);
-	//fs_close(inumber);
+	fs_close(handle);
 	return 1;
 }
 
 
-static int do_insert( const char *filename, int inumber, int at_offset )
+static int do_insert( const char *filename, int inumber, long at_offset )
 {
 	FILE *file;
-	int offset= at_offset, result, actual;
+	long offset= at_offset, actual;
+	int result, handle;
 	char buffer[500];
 
 	file = fopen(filename,"r");
@@ -272,6 +339,12 @@ static int do_insert( const char *filename, int inumber, int at_offset )
 		return 0;
 	}
 
+	handle = fs_open(inumber);
+	if(handle<0) {
+		fclose(file);
+		return 0;
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 #ifdef DEBUG
@@ -279,18 +352,116 @@ static int do_insert( const char *filename, int inumber, int at_offset )
 #endif
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_pwrite(handle,buffer,result,offset);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_pwrite return invalid result %ld\n",actual);
 				break;
 			}
 			offset += actual;
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%ld bytes copied\n",offset);
 
 	fclose(file);
-	// fs_close(inumber);
+	fs_close(handle);
 	return 1;
 }
+
+/* Returns the upper bound of the histogram bucket below which a fraction p of the values are. */
+static long histogram_percentile( const long *histogram, int nbuckets, double p )
+{
+	long total=0, seen=0;
+	for(int i=0;i<nbuckets;i++) total += histogram[i];
+	if(total==0) return 0;
+	for(int i=0;i<nbuckets;i++) {
+		seen += histogram[i];
+		if(seen >= p*total) return 1L<<(i+1);
+	}
+	return 1L<<nbuckets;
+}
+
+static void print_duration( long ns )
+{
+	if(ns<1000) printf("%ldns",ns);
+	else if(ns<1000000) printf("%.1fus",ns/1e3);
+	else printf("%.1fms",ns/1e6);
+}
+
+/* Prints the non-empty buckets of a histogram as <first value>-<last value>:<count>. */
+static void print_histogram( const long *histogram, int nbuckets )
+{
+	for(int i=0;i<nbuckets;i++) {
+		if(histogram[i]==0) continue;
+		if(i==0) printf(" 0-1:%ld",histogram[i]);
+		else if(i==nbuckets-1) printf(" %ld+:%ld",1L<<i,histogram[i]);
+		else printf(" %ld-%ld:%ld",1L<<i,(1L<<(i+1))-1,histogram[i]);
+	}
+	printf("\n");
+}
+
+static void print_json_array( const char *name, const long *values, int n )
+{
+	printf("\"%s\":[",name);
+	for(int i=0;i<n;i++) printf(i>0?",%ld":"%ld",values[i]);
+	printf("]");
+}
+
+static void print_op( const char *name, const struct fs_op_stats *op, int json )
+{
+	if(json) {
+		printf(",\"%s\":{\"count\":%ld,\"errors\":%ld,\"bytes\":%ld,",name,op->count,op->errors,op->bytes);
+		print_json_array("latency_ns",op->latency,FS_STATS_BUCKETS);
+		printf("}");
+		return;
+	}
+	printf("%-7s %ld calls, %ld errors, %ld bytes",name,op->count,op->errors,op->bytes);
+	if(op->count>0) {
+		printf(", latency p50 < ");
+		print_duration(histogram_percentile(op->latency,FS_STATS_BUCKETS,0.5));
+		printf(", p99 < ");
+		print_duration(histogram_percentile(op->latency,FS_STATS_BUCKETS,0.99));
+	}
+	printf("\n");
+}
+
+/* Prints the statistics of the disk and of the file system, as text or as a JSON object;
+histogram bucket i counts the values from 2^i to 2^(i+1)-1. */
+static void do_stats( int json )
+{
+	struct disk_stats disk;
+	struct fs_stats fs;
+
+	disk_stats(&disk);
+	fs_stats(&fs);
+	if(json) {
+		printf("{\"disk\":{\"reads\":%ld,\"writes\":%ld,\"read_ops\":%ld,\"write_ops\":%ld,\"hits\":%ld,\"misses\":%ld,"
+			"\"readahead_blocks\":%ld,\"readahead_hits\":%ld,\"readahead_wasted\":%ld,\"throttled_writes\":%ld,"
+			"\"evictions_clean\":%ld,\"evictions_dirty\":%ld,\"flushes\":%ld,\"flush_blocks\":%ld,",
+			disk.reads,disk.writes,disk.read_ops,disk.write_ops,disk.hits,disk.misses,
+			disk.ra_blocks,disk.ra_hits,disk.ra_wasted,disk.throttled_writes,
+			disk.evictions_clean,disk.evictions_dirty,disk.flushes,disk.flush_blocks);
+		print_json_array("flush_batch",disk.flush_batch,DISK_STATS_BUCKETS);
+		printf("},\"fs\":{\"allocations\":%ld,\"alloc_words\":%ld,",fs.allocations,fs.alloc_words);
+		print_json_array("alloc_scan",fs.alloc_scan,FS_STATS_BUCKETS);
+		print_op("read",&fs.read,1);
+		print_op("write",&fs.write,1);
+		print_op("create",&fs.create,1);
+		print_op("delete",&fs.delete,1);
+		printf("}}\n");
+		return;
+	}
+	printf("disk: %ld blocks read in %ld operations, %ld written in %ld\n",disk.reads,disk.read_ops,disk.writes,disk.write_ops);
+	printf("cache: %ld hits, %ld misses",disk.hits,disk.misses);
+	if(disk.hits+disk.misses>0) printf(" (%.1f%% hits)",100.0*disk.hits/(disk.hits+disk.misses));
+	printf("; %ld clean and %ld dirty evictions\n",disk.evictions_clean,disk.evictions_dirty);
+	printf("readahead: %ld blocks, %ld used, %ld wasted; %ld throttled writes\n",disk.ra_blocks,disk.ra_hits,disk.ra_wasted,disk.throttled_writes);
+	printf("flushes: %ld of %ld blocks, by blocks:",disk.flushes,disk.flush_blocks);
+	print_histogram(disk.flush_batch,DISK_STATS_BUCKETS);
+	print_op("read",&fs.read,0);
+	print_op("write",&fs.write,0);
+	print_op("create",&fs.create,0);
+	print_op("delete",&fs.delete,0);
+	printf("allocator: %ld searches through %ld words, by words:",fs.allocations,fs.alloc_words);
+	print_histogram(fs.alloc_scan,FS_STATS_BUCKETS);
+}
@@ -0,0 +1,207 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*Stress test of the locking of the file system and of the disk cache: several threads create, write,
+read back and delete files of their own at the same time, through fs_write/fs_read and through handles,
+while they all read a shared file and now and then sync the file system. Every read is checked
+against what was written. Then a sparse file gets data past 4 GiB, which has to read back after a remount.
+Exits with 0 if everything matched.*/
+
+#define MAX_THREADS 64
+#define MAX_FILE (14 * DISK_BLOCK_SIZE)	// a few blocks past the direct pointers
+#define LARGE_OFFSET ((4L << 30) + (1 << 20))	// where the sparse file ends, past what 32 bits can address
+
+static const char *image = "stress.img";
+static int nblocks = 4000;
+static int nthreads = 8;
+static int iterations = 300;
+static int shared;	// i-node of the file that every thread reads
+static int large;	// i-node of the sparse file
+static int failed = 0;
+
+/*Contents of byte i of a file written by thread in its iteration.*/
+static char pattern( int thread, int iteration, int i )
+{
+	return (char)(thread * 31 + iteration * 7 + i);
+}
+
+static void fail( const char *message, int thread, int iteration )
+{
+	fprintf(stderr, "thread %d, iteration %d: %s\n", thread, iteration, message);
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+/*Writes length bytes of data to the file inumber in pieces of random size through a handle.
+Returns the number of bytes written.*/
+static int write_pieces( int inumber, const char *data, int length, unsigned int *seed )
+{
+	int handle = fs_open(inumber);
+	if (handle < 0) {
+		return 0;
+	}
+	int written = 0;
+	while (written < length) {
+		int piece = 1 + rand_r(seed) % (2 * DISK_BLOCK_SIZE);
+		int n = fs_pwrite(handle, (char*)data + written, piece < length - written ? piece : length - written, written);
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+	fs_close(handle);
+	return written;
+}
+
+static void *worker( void *argument )
+{
+	int thread = (int)(long)argument;
+	unsigned int seed = thread + 1;
+	char *data = malloc(MAX_FILE);
+	char *back = malloc(MAX_FILE);
+	char block[DISK_BLOCK_SIZE];
+
+	for (int iteration = 0; iteration < iterations && !__atomic_load_n(&failed, __ATOMIC_RELAXED); iteration++) {
+		int inumber = fs_create();
+		if (inumber < 0) {
+			fail("fs_create failed", thread, iteration);
+			break;
+		}
+		int length = 1 + rand_r(&seed) % MAX_FILE;
+		for (int i = 0; i < length; i++) {
+			data[i] = pattern(thread, iteration, i);
+		}
+		int written = iteration % 2 ? fs_write(inumber, data, length, 0) : write_pieces(inumber, data, length, &seed);
+		if (written != length) {
+			fail("short write", thread, iteration);
+		} else if (fs_getsize(inumber) != length) {
+			fail("wrong size", thread, iteration);
+		} else {
+			memset(back, 0, length);
+			if (fs_read(inumber, back, length, 0) != length || memcmp(data, back, length) != 0) {
+				fail("the file does not read back what was written", thread, iteration);
+			}
+		}
+		int n = fs_read(shared, block, DISK_BLOCK_SIZE, 2 * DISK_BLOCK_SIZE);
+		for (int i = 0; i < n; i++) {
+			if (block[i] != (char)(2 * DISK_BLOCK_SIZE + i)) {
+				fail("the shared file changed", thread, iteration);
+				break;
+			}
+		}
+		if (fs_delete(inumber) != 0) {
+			fail("fs_delete failed", thread, iteration);
+		}
+		if (iteration % 50 == 0) {
+			fs_sync();
+		}
+	}
+	free(data);
+	free(back);
+	return NULL;
+}
+
+static void usage( const char *program )
+{
+	fprintf(stderr, "use: %s [-i image] [-b nblocks] [-t threads] [-n iterations] [-l blocks|extents] [option=value ...]\n", program);
+	fprintf(stderr, "options: the disk options of the shell; the image is overwritten and removed\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	struct disk_config config;
+	int layout = FS_LAYOUT_BLOCKS;
+
+	disk_config_default(&config);
+	for (int i = 1; i < argc; i++) {
+		if (argv[i][0] == '-' && i + 1 < argc && strlen(argv[i]) == 2) {
+			char *value = argv[++i];
+			switch (argv[i - 1][1]) {
+			case 'i': image = value; break;
+			case 'b': nblocks = atoi(value); break;
+			case 't': nthreads = atoi(value); break;
+			case 'n': iterations = atoi(value); break;
+			case 'l': layout = strcmp(value, "extents") == 0 ? FS_LAYOUT_EXTENTS : FS_LAYOUT_BLOCKS; break;
+			default: usage(argv[0]); return 1;
+			}
+		} else if (strchr(argv[i], '=') != NULL) {
+			if (disk_config_set(&config, argv[i]) < 0) {
+				fprintf(stderr, "invalid disk option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nthreads <= 0 || nthreads > MAX_THREADS || iterations <= 0 || nblocks <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	unlink(image);
+	if (!disk_init_config(image, nblocks, &config)) {
+		perror(image);
+		return 1;
+	}
+	if (fs_format_layout(layout) != 0 || fs_mount() != 0) {
+		fprintf(stderr, "cannot create the file system\n");
+		return 1;
+	}
+	static char contents[MAX_FILE];
+	for (int i = 0; i < MAX_FILE; i++) {
+		contents[i] = (char)i;
+	}
+	shared = fs_create();
+	if (shared < 0 || fs_write(shared, contents, MAX_FILE, 0) != MAX_FILE) {
+		fprintf(stderr, "cannot write the shared file\n");
+		return 1;
+	}
+
+	pthread_t threads[MAX_THREADS];
+	for (long t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t], NULL, worker, (void*)t);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	// the sparse file has data across the 4 GiB boundary and at its end, and holes elsewhere
+	large = fs_create();
+	if (large < 0 || fs_write(large, contents, MAX_FILE, (4L << 30) - MAX_FILE / 2) != MAX_FILE
+			|| fs_write(large, contents, MAX_FILE, LARGE_OFFSET - MAX_FILE) != MAX_FILE) {
+		fprintf(stderr, "cannot write the sparse file\n");
+		failed = 1;
+	}
+	if (fs_write(large, contents, 1, -1) != -1 || fs_read(large, contents, 1, -1) != -1) {
+		fprintf(stderr, "negative offsets are not rejected\n");
+		failed = 1;
+	}
+
+	// the shared file and the sparse file survive a remount
+	fs_unmount();
+	static char back[MAX_FILE];
+	if (fs_mount() != 0 || fs_read(shared, back, MAX_FILE, 0) != MAX_FILE || memcmp(back, contents, MAX_FILE) != 0) {
+		fprintf(stderr, "the shared file is not as it was left\n");
+		failed = 1;
+	}
+	static char zeros[MAX_FILE];
+	if (fs_getsize(large) != LARGE_OFFSET
+			|| fs_read(large, back, MAX_FILE, (4L << 30) - MAX_FILE / 2) != MAX_FILE || memcmp(back, contents, MAX_FILE) != 0
+			|| fs_read(large, back, MAX_FILE, LARGE_OFFSET - MAX_FILE) != MAX_FILE || memcmp(back, contents, MAX_FILE) != 0
+			|| fs_read(large, back, MAX_FILE, 3L << 30) != MAX_FILE || memcmp(back, zeros, MAX_FILE) != 0
+			|| fs_read(large, back, MAX_FILE, LARGE_OFFSET - 1) != 1) {
+		fprintf(stderr, "the sparse file is not as it was written\n");
+		failed = 1;
+	}
+	fs_unmount();
+	disk_close();
+	unlink(image);
+	printf("%s: %d threads, %d iterations each\n", failed ? "FAILED" : "OK", nthreads, iterations);
+	return failed;
+}